@@ -3,27 +3,66 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <poll.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_WAIT4
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_MEMFD
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include "build.h"
+#include "cgroup.h"
 #include "deps.h"
 #include "env.h"
 #include "graph.h"
 #include "log.h"
 #include "os.h"
+#include "rss.h"
 #include "util.h"
+#include "worker.h"
+
+enum {
+	/* output of a job beyond this size is moved out of memory */
+	SPILLSIZE = 1 << 20,
+	/* least time in milliseconds between updates of the status line */
+	REFRESHMS = 100,
+	/* number of jobs and rules listed in the summary of the build */
+	NSLOWEST = 10,
+};
 
 struct job {
 	struct string *cmd;
 	struct edge *edge;
 	struct buffer buf;
+	/* output that did not fit in buf, or NULL */
+	FILE *spill;
+	/* last byte of the spilled output */
+	char spilllast;
 	size_t next;
+	/* start time and expected duration in milliseconds */
+	uint64_t start, estimate;
+	/* expected peak memory use in KiB */
+	uint64_t rss;
+	/* job slots taken */
+	size_t weight;
+	/* cgroup the job runs in, or NULL */
+	struct cgroup *cgroup;
+	/* worker the job runs in, or NULL, and the exit status it reported,
+	 * or -1 if the worker failed */
+	struct worker *worker;
+	int status;
 	pid_t pid;
 	int fd;
 	bool failed;
@@ -32,17 +71,80 @@ struct job {
 struct buildoptions buildopts = {.maxfail = 1};
 static struct edge *work;
 static size_t nstarted, nfinished, ntotal;
+/* the sum and number of the durations in milliseconds of the jobs to run that
+ * are known from the build log, which give the expected duration of the rest */
+static uint64_t knowntime, avgtime;
+static size_t nknown;
+/* expected duration of all jobs, of finished jobs, and of running jobs, and
+ * the sum of the start times of the running jobs */
+static uint64_t totaltime, donetime, runtime, runstart;
+static size_t nrunning;
+/* the current limit of parallel jobs */
+static size_t jobslimit;
+/* number of edges waiting for their pool */
+static size_t npoolwait;
+
+/* why job slots were left idle, for the summary of the build */
+enum idlecause {
+	IDLE_NONE,
+	IDLE_DEPS,
+	IDLE_POOL,
+	IDLE_LOAD,
+	IDLE_MEMORY,
+	NIDLE,
+};
+
+struct rulestats {
+	int name;
+	uint64_t time;
+	size_t count;
+};
+
+/* statistics printed at the end of the build with -d stats */
+static struct {
+	/* the slowest jobs, slowest first */
+	struct {
+		struct edge *edge;
+		uint64_t time;
+	} slowest[NSLOWEST];
+	size_t nslowest;
+	/* total time of the jobs of each rule, indexed by rule name */
+	struct rulestats *rule;
+	size_t rulelen;
+	/* the integral of the number of running jobs over time, and its peak */
+	uint64_t jobtime;
+	size_t peakjobs;
+	/* the time that each job slot was left idle, summed over the slots, by
+	 * cause */
+	uint64_t idletime[NIDLE];
+	/* the jobs running, the idle job slots, and their cause since the last
+	 * update */
+	uint64_t last;
+	size_t numjobs, idleslots;
+	enum idlecause cause;
+	/* the last time that more than one job was running */
+	uint64_t lastparallel;
+} stats;
 static bool consoleused;
 static struct timespec starttime;
 static int sigfd[2];
+/* on a smart terminal, the status of the last started edge is shown on a
+ * single line, which is overwritten at most every REFRESHMS */
+static bool smartterm, statusdirty, statusshown;
+static struct edge *statusedge;
+static struct string *statuscmd;
+static struct timespec lastrefresh;
 
 void
 buildreset(void)
 {
 	struct edge *e;
 
+	/* the outputs of edges that ran were checked again when they finished,
+	 * so their dirtiness is computed again from scratch, as it would be
+	 * after a reparse */
 	for (e = alledges; e; e = e->allnext)
-		e->flags &= ~FLAG_WORK;
+		e->flags &= ~(FLAG_WORK | FLAG_DIRTY);
 }
 
 /* returns whether n1 is newer than n2, or false if n1 is NULL */
@@ -106,6 +208,44 @@ isdirty(struct node *n, struct node *newest, bool generator, bool restat)
 	return true;
 }
 
+/* returns the duration in milliseconds of the last job of an edge, from the
+ * build log, or -1 if it is not known */
+static int64_t
+lastduration(struct edge *e)
+{
+	struct node *n;
+
+	if (e->nout == 0)
+		return -1;
+	n = e->out[0];
+	if (n->logmtime == MTIME_MISSING || n->logend <= n->logstart)
+		return -1;
+	return n->logend - n->logstart;
+}
+
+/* returns the expected duration in milliseconds of the job of an edge */
+static uint64_t
+estimate(struct edge *e)
+{
+	int64_t duration;
+
+	duration = lastduration(e);
+	return duration >= 0 ? (uint64_t)duration : avgtime;
+}
+
+/* returns the time in milliseconds since the build started */
+static uint64_t
+elapsed(void)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+		warn("clock_gettime:");
+		return 0;
+	}
+	return (now.tv_sec - starttime.tv_sec) * 1000 + (now.tv_nsec - starttime.tv_nsec) / 1000000;
+}
+
 /* add an edge to the work queue */
 static void
 queue(struct edge *e)
@@ -113,22 +253,121 @@ queue(struct edge *e)
 	struct edge **front = &work;
 
 	if (e->pool && e->rule != &phonyrule) {
-		if (e->pool->numjobs == e->pool->maxjobs)
+		/* while edges are waiting for the pool, they are given the
+		 * free slots first, so a heavy edge is not starved */
+		if (e->pool->work || e->pool->numjobs + e->weight > (size_t)e->pool->maxjobs) {
 			front = &e->pool->work;
-		else
-			++e->pool->numjobs;
+			++npoolwait;
+		} else
+			e->pool->numjobs += e->weight;
 	}
 	e->worknext = *front;
 	*front = e;
 }
 
-void
-buildadd(struct node *n)
+#ifdef HAVE_PTHREAD
+enum {
+	/* fewer files than this are not worth starting threads for */
+	PREFETCHMIN = 256,
+	PREFETCHTHREADS = 32,
+};
+
+static struct node **prefetchlist;
+static size_t nprefetch, prefetchcap, nprefetchthread;
+
+static void
+prefetchqueue(struct node *n)
+{
+	if (n->mtime != MTIME_UNKNOWN)
+		return;
+	n->mtime = MTIME_QUEUED;
+	if (nprefetch == prefetchcap) {
+		prefetchcap = prefetchcap ? prefetchcap * 2 : 1024;
+		prefetchlist = xreallocarray(prefetchlist, prefetchcap, sizeof(prefetchlist[0]));
+	}
+	prefetchlist[nprefetch++] = n;
+}
+
+static void *
+prefetchthread(void *arg)
+{
+	size_t i;
+
+	for (i = *(size_t *)arg; i < nprefetch; i += nprefetchthread)
+		nodestat(prefetchlist[i]);
+	return NULL;
+}
+
+/* stat the files a target depends on using several threads, so that
+ * buildadd finds their mtimes already known */
+static void
+prefetch(struct node *root)
+{
+	static struct edge **stack;
+	static size_t stackcap;
+	static size_t first[PREFETCHTHREADS];
+	pthread_t thread[PREFETCHTHREADS];
+	bool started[PREFETCHTHREADS];
+	size_t nstack, i, j, ndeps;
+	struct edge *e;
+	struct node *n, **deps;
+	long nproc;
+
+	if (root->mtime != MTIME_UNKNOWN)
+		return;
+	nprefetch = 0;
+	nstack = 0;
+	prefetchqueue(root);
+	e = root->gen;
+	/* only edges reached through an output that was not yet queued are
+	 * visited, so each is visited at most once per output */
+	while (e) {
+		for (i = 0; i < e->nout; ++i)
+			prefetchqueue(e->out[i]);
+		deps = depsrecorded(e->out[0], &ndeps);
+		for (i = 0; i < e->nin + ndeps; ++i) {
+			n = i < e->nin ? e->in[i] : deps[i - e->nin];
+			if (n->mtime != MTIME_UNKNOWN)
+				continue;
+			prefetchqueue(n);
+			if (!n->gen)
+				continue;
+			if (nstack == stackcap) {
+				stackcap = stackcap ? stackcap * 2 : 64;
+				stack = xreallocarray(stack, stackcap, sizeof(stack[0]));
+			}
+			stack[nstack++] = n->gen;
+		}
+		e = nstack > 0 ? stack[--nstack] : NULL;
+	}
+
+	nproc = osnproc();
+	nprefetchthread = nproc < 1 ? 1 : nproc > PREFETCHTHREADS ? PREFETCHTHREADS : nproc;
+	if (nprefetch < PREFETCHMIN)
+		nprefetchthread = 1;
+	for (i = 0; i < nprefetchthread; ++i)
+		first[i] = i;
+	for (i = 1; i < nprefetchthread; ++i)
+		started[i] = pthread_create(&thread[i], NULL, prefetchthread, &first[i]) == 0;
+	prefetchthread(&first[0]);
+	for (i = 1; i < nprefetchthread; ++i) {
+		if (started[i]) {
+			pthread_join(thread[i], NULL);
+		} else {
+			for (j = i; j < nprefetch; j += nprefetchthread)
+				nodestat(prefetchlist[j]);
+		}
+	}
+}
+#endif
+
+/* start checking a node, returning its generating edge if the edge's inputs
+ * must be checked first */
+static struct edge *
+addstart(struct node *n)
 {
 	struct edge *e;
-	struct node *newest;
 	size_t i;
-	bool generator, restat;
 
 	e = n->gen;
 	if (!e) {
@@ -137,12 +376,12 @@ buildadd(struct node *n)
 		if (n->mtime == MTIME_MISSING)
 			fatal("file is missing and not created by any action: '%s'", n->path->s);
 		n->dirty = false;
-		return;
+		return NULL;
 	}
 	if (e->flags & FLAG_CYCLE)
 		fatal("dependency cycle involving '%s'", n->path->s);
 	if (e->flags & FLAG_WORK)
-		return;
+		return NULL;
 	e->flags |= FLAG_CYCLE | FLAG_WORK;
 	for (i = 0; i < e->nout; ++i) {
 		n = e->out[i];
@@ -152,22 +391,39 @@ buildadd(struct node *n)
 	}
 	depsload(e);
 	e->nblock = 0;
-	newest = NULL;
-	for (i = 0; i < e->nin; ++i) {
-		n = e->in[i];
-		buildadd(n);
-		if (i < e->inorderidx) {
-			if (n->dirty)
-				e->flags |= FLAG_DIRTY_IN;
-			if (n->mtime != MTIME_MISSING && !isnewer(newest, n))
-				newest = n;
-		}
-		if (n->dirty || (n->gen && n->gen->nblock > 0))
-			++e->nblock;
+
+	return e;
+}
+
+/* account for an input of an edge after it was checked */
+static void
+addinput(struct edge *e, size_t i, struct node **newest)
+{
+	struct node *n;
+
+	n = e->in[i];
+	if (i < e->inorderidx) {
+		if (n->dirty)
+			e->flags |= FLAG_DIRTY_IN;
+		if (n->mtime != MTIME_MISSING && !isnewer(*newest, n))
+			*newest = n;
 	}
+	if (n->dirty || (n->gen && n->gen->nblock > 0))
+		++e->nblock;
+}
+
+/* finish checking an edge after all its inputs were checked */
+static void
+addfinish(struct edge *e, struct node *newest)
+{
+	struct node *n;
+	size_t i;
+	bool generator, restat;
+	int64_t duration;
+
 	/* all outputs are dirty if any are older than the newest input */
-	generator = edgevar(e, "generator", true);
-	restat = edgevar(e, "restat", true);
+	generator = edgevar(e, SYM_GENERATOR, true);
+	restat = edgevar(e, SYM_RESTAT, true);
 	for (i = 0; i < e->nout && !(e->flags & FLAG_DIRTY_OUT); ++i) {
 		n = e->out[i];
 		if (isdirty(n, newest, generator, restat)) {
@@ -192,18 +448,121 @@ buildadd(struct node *n)
 	if (e->flags & FLAG_DIRTY) {
 		if (e->nblock == 0)
 			queue(e);
-		if (e->rule != &phonyrule)
+		if (e->rule != &phonyrule) {
 			++ntotal;
+			duration = lastduration(e);
+			if (duration >= 0) {
+				knowntime += duration;
+				++nknown;
+			}
+		}
 	}
 	e->flags &= ~FLAG_CYCLE;
 }
 
+/* depth-first traversal, with an explicit stack so that deep graphs can't
+ * overflow the call stack */
+static void
+addnode(struct node *n)
+{
+	static struct addframe {
+		struct edge *edge;
+		struct node *newest;
+		/* the next input to check, and whether it was started */
+		size_t next;
+		bool started;
+	} *stack;
+	static size_t stackcap;
+	struct addframe *f;
+	struct edge *e;
+	size_t len;
+
+	e = addstart(n);
+	len = 0;
+	while (e) {
+		if (len == stackcap) {
+			stackcap = stackcap ? stackcap * 2 : 64;
+			stack = xreallocarray(stack, stackcap, sizeof(stack[0]));
+		}
+		stack[len++] = (struct addframe){.edge = e};
+		e = NULL;
+		while (!e && len > 0) {
+			f = &stack[len - 1];
+			if (f->next == f->edge->nin) {
+				addfinish(f->edge, f->newest);
+				--len;
+			} else if (!f->started) {
+				f->started = true;
+				e = addstart(f->edge->in[f->next]);
+			} else {
+				addinput(f->edge, f->next, &f->newest);
+				++f->next;
+				f->started = false;
+			}
+		}
+	}
+}
+
+void
+buildadd(struct node *n)
+{
+#ifdef HAVE_PTHREAD
+	prefetch(n);
+#endif
+	addnode(n);
+}
+
+/* returns the fraction of the expected duration of all jobs that is done */
+static double
+progress(uint64_t now)
+{
+	uint64_t done, partial;
+
+	if (totaltime == 0)
+		return ntotal ? (double)nfinished / ntotal : 1;
+	/* count the time that running jobs have run so far, up to what they
+	 * are expected to take */
+	partial = nrunning * now - runstart;
+	done = donetime + (partial < runtime ? partial : runtime);
+	return done < totaltime ? (double)done / totaltime : 1;
+}
+
+/* returns the expected time in milliseconds until the build is done, with
+ * as many jobs running in parallel as allowed, or -1 if it is not known */
+static int64_t
+remaining(uint64_t now)
+{
+	size_t left, parallel;
+
+	left = ntotal - nfinished;
+	if (totaltime == 0)
+		return nfinished ? (int64_t)(now * left / nfinished) : -1;
+	parallel = jobslimit < left ? jobslimit : left;
+	if (parallel == 0)
+		return 0;
+	return (1 - progress(now)) * totaltime / parallel;
+}
+
+static int
+formattime(char *buf, size_t len, int64_t ms)
+{
+	int64_t s;
+
+	if (ms < 0)
+		return snprintf(buf, len, "?");
+	s = ms / 1000;
+	if (s >= 3600)
+		return snprintf(buf, len, "%" PRId64 ":%02d:%02d", s / 3600, (int)(s / 60 % 60), (int)(s % 60));
+	return snprintf(buf, len, "%02d:%02d", (int)(s / 60), (int)(s % 60));
+}
+
 static size_t
 formatstatus(char *buf, size_t len)
 {
 	const char *fmt;
 	size_t ret = 0;
 	int n;
+	int64_t ms;
 	struct timespec endtime;
 
 	for (fmt = buildopts.statusfmt; *fmt; ++fmt) {
@@ -249,6 +608,19 @@ formatstatus(char *buf, size_t len)
 			}
 			n = snprintf(buf, len, "%.3f", (endtime.tv_sec - starttime.tv_sec) + 0.000000001 * (endtime.tv_nsec - starttime.tv_nsec));
 			break;
+		case 'w':
+			n = formattime(buf, len, elapsed());
+			break;
+		case 'P':
+			n = snprintf(buf, len, "%3d%%", (int)(100 * progress(elapsed())));
+			break;
+		case 'E':
+			ms = remaining(elapsed());
+			n = ms < 0 ? snprintf(buf, len, "?") : snprintf(buf, len, "%.1f", ms / 1000.0);
+			break;
+		case 'W':
+			n = formattime(buf, len, remaining(elapsed()));
+			break;
 		default:
 			fatal("unknown placeholder '%%%c' in $NINJA_STATUS", *fmt);
 			continue;  /* unreachable, but avoids warning */
@@ -266,15 +638,98 @@ formatstatus(char *buf, size_t len)
 	return ret;
 }
 
+static struct string *
+edgedescription(struct edge *e, struct string *cmd)
+{
+	struct string *description;
+
+	description = buildopts.verbose ? NULL : edgevar(e, SYM_DESCRIPTION, true);
+	if (!description || description->n == 0)
+		description = cmd;
+	return description;
+}
+
+static size_t
+termwidth(void)
+{
+#ifdef TIOCGWINSZ
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		return ws.ws_col;
+#endif
+	return 80;
+}
+
+/* redraw the status line of a smart terminal if it changed, unless it was
+ * drawn less than REFRESHMS ago and force is not set */
+static void
+refreshstatus(bool force)
+{
+	struct string *description;
+	struct timespec now;
+	char status[256];
+	size_t width, len, avail, head;
+
+	if (!statusdirty || !statusedge)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!force && (now.tv_sec - lastrefresh.tv_sec) * 1000 + (now.tv_nsec - lastrefresh.tv_nsec) / 1000000 < REFRESHMS)
+		return;
+	lastrefresh = now;
+	statusdirty = false;
+	statusshown = true;
+
+	description = edgedescription(statusedge, statuscmd);
+	formatstatus(status, sizeof(status));
+	/* leave the last column empty so the terminal does not wrap */
+	width = termwidth() - 1;
+	len = strlen(status);
+	putchar('\r');
+	if (len + description->n <= width) {
+		fputs(status, stdout);
+		fputs(description->s, stdout);
+	} else if (len + 3 < width) {
+		/* elide the middle of the description */
+		avail = width - len - 3;
+		head = avail / 2;
+		fputs(status, stdout);
+		fwrite(description->s, 1, head, stdout);
+		fputs("...", stdout);
+		fwrite(description->s + description->n - (avail - head), 1, avail - head, stdout);
+	} else {
+		fwrite(status, 1, len < width ? len : width, stdout);
+	}
+	fputs("\033[K", stdout);
+	fflush(stdout);
+}
+
+/* end the status line of a smart terminal, so that other output goes below
+ * it */
+static void
+endstatus(void)
+{
+	refreshstatus(true);
+	if (statusshown) {
+		putchar('\n');
+		statusshown = false;
+	}
+}
+
 static void
 printstatus(struct edge *e, struct string *cmd)
 {
 	struct string *description;
 	char status[256];
 
-	description = buildopts.verbose ? NULL : edgevar(e, "description", true);
-	if (!description || description->n == 0)
-		description = cmd;
+	if (smartterm) {
+		statusedge = e;
+		statuscmd = cmd;
+		statusdirty = true;
+		refreshstatus(false);
+		return;
+	}
+	description = edgedescription(e, cmd);
 	formatstatus(status, sizeof(status));
 	fputs(status, stdout);
 	puts(description->s);
@@ -285,9 +740,10 @@ jobstart(struct job *j, struct edge *e)
 {
 	size_t i;
 	struct node *n;
-	struct string *rspfile, *content;
+	struct string *rspfile, *content, *worker;
 	int fd[2], outfd;
 	char *argv[] = {"/bin/sh", "-c", NULL, NULL};
+	struct cgroupusage usage;
 
 	++nstarted;
 	for (i = 0; i < e->nout; ++i) {
@@ -297,13 +753,35 @@ jobstart(struct job *j, struct edge *e)
 				goto err0;
 		}
 	}
-	rspfile = edgevar(e, "rspfile", false);
+	rspfile = edgevar(e, SYM_RSPFILE, false);
 	if (rspfile) {
-		content = edgevar(e, "rspfile_content", true);
+		content = edgevar(e, SYM_RSPFILE_CONTENT, true);
 		if (writefile(rspfile->s, content) < 0)
 			goto err0;
 	}
 
+	j->edge = e;
+	j->cmd = edgevar(e, SYM_COMMAND, true);
+	j->status = 0;
+	j->cgroup = NULL;
+	j->worker = NULL;
+	worker = e->pool == &consolepool ? NULL : edgevar(e, SYM_WORKER, true);
+	if (worker && worker->n > 0) {
+		/* send the command to a persistent worker instead */
+		j->worker = workerget(worker);
+		if (!j->worker)
+			goto err1;
+		j->fd = workersend(j->worker, j->cmd);
+		if (j->fd < 0) {
+			workerrelease(j->worker, false);
+			goto err1;
+		}
+		j->pid = workerpid(j->worker);
+		if (!consoleused)
+			printstatus(e, j->cmd);
+		goto started;
+	}
+
 	if (pipe(fd) < 0) {
 		warn("pipe:");
 		goto err1;
@@ -312,14 +790,14 @@ jobstart(struct job *j, struct edge *e)
 		warn("fcntl CLOEXEC:");
 		goto err2;
 	}
-	j->edge = e;
-	j->cmd = edgevar(e, "command", true);
 	j->fd = fd[0];
 	argv[2] = j->cmd->s;
 
 	if (!consoleused)
 		printstatus(e, j->cmd);
 	if (e->pool == &consolepool) {
+		/* the job writes to the terminal below the status line */
+		endstatus();
 		outfd = -1;
 	} else {
 		if (fcntl(fd[1], F_SETFD, FD_CLOEXEC) != 0) {
@@ -328,17 +806,27 @@ jobstart(struct job *j, struct edge *e)
 		}
 		outfd = fd[1];
 	}
-	j->pid = osspawn(argv, outfd);
+	j->cgroup = cgroupjob(e);
+	j->pid = osspawn(argv, outfd, j->cgroup ? cgroupfd(j->cgroup) : -1);
 	if (j->pid == -1)
-		goto err2;
+		goto err3;
 	close(fd[1]);
 
+started:
 	j->failed = false;
 	if (e->pool == &consolepool)
 		consoleused = true;
+	j->start = elapsed();
+	j->estimate = estimate(e);
+	runstart += j->start;
+	runtime += j->estimate;
+	++nrunning;
 
 	return j->fd;
 
+err3:
+	if (j->cgroup)
+		cgroupdone(j->cgroup, &usage);
 err2:
 	close(fd[0]);
 	close(fd[1]);
@@ -352,22 +840,48 @@ err0:
 static void
 nodedone(struct node *n, bool prune)
 {
+	static struct doneframe {
+		struct node *node;
+		size_t next;
+		bool prune;
+	} *stack;
+	static size_t stackcap;
+	struct doneframe *f;
 	struct edge *e;
-	size_t i, j;
+	size_t len, j;
 
-	for (i = 0; i < n->nuse; ++i) {
-		e = n->use[i];
+	if (!stack) {
+		stackcap = 64;
+		stack = xreallocarray(NULL, stackcap, sizeof(stack[0]));
+	}
+	len = 0;
+	stack[len++] = (struct doneframe){n, 0, prune};
+	while (len > 0) {
+		f = &stack[len - 1];
+		if (f->next == f->node->nuse) {
+			--len;
+			continue;
+		}
+		e = f->node->use[f->next++];
 		/* skip edges not used in this build */
 		if (!(e->flags & FLAG_WORK))
 			continue;
-		if (!(e->flags & (prune ? FLAG_DIRTY_OUT : FLAG_DIRTY)) && --e->nprune == 0) {
+		if (!(e->flags & (f->prune ? FLAG_DIRTY_OUT : FLAG_DIRTY)) && --e->nprune == 0) {
 			/* either edge was clean (possible with order-only
 			 * inputs), or all its blocking inputs were pruned, so
 			 * its outputs can be pruned as well */
-			for (j = 0; j < e->nout; ++j)
-				nodedone(e->out[j], true);
-			if (e->flags & FLAG_DIRTY && e->rule != &phonyrule)
+			if (e->flags & FLAG_DIRTY && e->rule != &phonyrule) {
 				--ntotal;
+				totaltime -= estimate(e);
+			}
+			/* push in reverse, so the first output is done first */
+			if (stackcap - len < e->nout) {
+				while (stackcap - len < e->nout)
+					stackcap *= 2;
+				stack = xreallocarray(stack, stackcap, sizeof(stack[0]));
+			}
+			for (j = e->nout; j > 0; --j)
+				stack[len++] = (struct doneframe){e->out[j - 1], 0, true};
 		} else if (--e->nblock == 0) {
 			queue(e);
 		}
@@ -404,7 +918,7 @@ edgedone(struct edge *e)
 	bool restat;
 	int64_t old;
 
-	restat = edgevar(e, "restat", true);
+	restat = edgevar(e, SYM_RESTAT, true);
 	for (i = 0; i < e->nout; ++i) {
 		n = e->out[i];
 		old = n->mtime;
@@ -412,7 +926,7 @@ edgedone(struct edge *e)
 		n->logmtime = n->mtime == MTIME_MISSING ? 0 : n->mtime;
 		nodedone(n, restat && shouldprune(e, n, old));
 	}
-	rspfile = edgevar(e, "rspfile", false);
+	rspfile = edgevar(e, SYM_RSPFILE, false);
 	if (rspfile && !buildopts.keeprsp)
 		remove(rspfile->s);
 	edgehash(e);
@@ -424,15 +938,278 @@ edgedone(struct edge *e)
 	}
 }
 
+/* account the time since the last update to the jobs that were running and to
+ * the cause of idle job slots, and start a new period with the given ones */
+static void
+statsupdate(size_t numjobs, size_t numslots, enum idlecause cause)
+{
+	uint64_t now, dt;
+
+	if (!buildopts.stats)
+		return;
+	now = elapsed();
+	dt = now - stats.last;
+	stats.jobtime += stats.numjobs * dt;
+	stats.idletime[stats.cause] += stats.idleslots * dt;
+	if (stats.numjobs > 1)
+		stats.lastparallel = now;
+	stats.last = now;
+	stats.numjobs = numjobs;
+	/* without a job limit, count the time that more jobs could run */
+	if (buildopts.maxjobs == (size_t)-1)
+		stats.idleslots = 1;
+	else
+		stats.idleslots = numslots < buildopts.maxjobs ? buildopts.maxjobs - numslots : 0;
+	stats.cause = cause;
+	if (numjobs > stats.peakjobs)
+		stats.peakjobs = numjobs;
+}
+
+/* record the time taken by a finished job */
+static void
+statsjob(struct edge *e, uint64_t time)
+{
+	struct rulestats *r;
+	size_t i, len;
+
+	if (!buildopts.stats)
+		return;
+	if ((size_t)e->rule->name >= stats.rulelen) {
+		len = stats.rulelen ? stats.rulelen : 64;
+		while (len <= (size_t)e->rule->name)
+			len *= 2;
+		stats.rule = xreallocarray(stats.rule, len, sizeof(stats.rule[0]));
+		memset(stats.rule + stats.rulelen, 0, (len - stats.rulelen) * sizeof(stats.rule[0]));
+		stats.rulelen = len;
+	}
+	r = &stats.rule[e->rule->name];
+	r->name = e->rule->name;
+	r->time += time;
+	++r->count;
+
+	/* keep the slowest jobs sorted */
+	for (i = stats.nslowest; i > 0 && stats.slowest[i - 1].time < time; --i) {
+		if (i < NSLOWEST)
+			stats.slowest[i] = stats.slowest[i - 1];
+	}
+	if (i < NSLOWEST) {
+		stats.slowest[i].edge = e;
+		stats.slowest[i].time = time;
+		if (stats.nslowest < NSLOWEST)
+			++stats.nslowest;
+	}
+}
+
+static int
+rulestatscmp(const void *p1, const void *p2)
+{
+	const struct rulestats *r1 = *(struct rulestats *const *)p1, *r2 = *(struct rulestats *const *)p2;
+
+	return r1->time < r2->time ? 1 : r1->time > r2->time ? -1 : 0;
+}
+
+static void
+printstats(void)
+{
+	static const char *const causes[] = {
+		[IDLE_DEPS] = "dependencies",
+		[IDLE_POOL] = "pools",
+		[IDLE_LOAD] = "load limit",
+		[IDLE_MEMORY] = "memory or weight",
+	};
+	struct rulestats **rules;
+	struct edge *e;
+	size_t i, n;
+	uint64_t wall;
+
+	statsupdate(0, 0, IDLE_NONE);
+	wall = stats.last;
+	printf("build summary:\n");
+	printf("  %-24s %10.3fs\n", "wall time", wall / 1000.0);
+	printf("  %-24s %10.1f\n", "average jobs", wall ? (double)stats.jobtime / wall : 0.0);
+	printf("  %-24s %10zu\n", "peak jobs", stats.peakjobs);
+	if (buildopts.maxjobs != (size_t)-1)
+		printf("  %-24s %10zu\n", "job limit", buildopts.maxjobs);
+	printf("  %-24s %10.3fs\n", "serial tail", (wall - stats.lastparallel) / 1000.0);
+	if (buildopts.maxjobs == (size_t)-1)
+		printf("time more jobs could run, waiting for:\n");
+	else
+		printf("idle job slot time, summed over slots, waiting for:\n");
+	for (i = IDLE_DEPS; i < NIDLE; ++i)
+		printf("  %-24s %10.3fs\n", causes[i], stats.idletime[i] / 1000.0);
+
+	printf("slowest jobs:\n");
+	for (i = 0; i < stats.nslowest; ++i) {
+		e = stats.slowest[i].edge;
+		printf("  %10.3fs %-16s %s\n", stats.slowest[i].time / 1000.0, symname(e->rule->name), e->nout > 0 ? e->out[0]->path->s : "");
+	}
+
+	rules = xreallocarray(NULL, stats.rulelen, sizeof(rules[0]));
+	n = 0;
+	for (i = 0; i < stats.rulelen; ++i) {
+		if (stats.rule[i].count > 0)
+			rules[n++] = &stats.rule[i];
+	}
+	qsort(rules, n, sizeof(rules[0]), rulestatscmp);
+	printf("rules by total time:\n");
+	printf("  %11s %11s %8s %s\n", "total", "mean", "jobs", "rule");
+	for (i = 0; i < n && i < NSLOWEST; ++i) {
+		printf("  %10.3fs %10.3fs %8zu %s\n", rules[i]->time / 1000.0,
+		       rules[i]->time / 1000.0 / rules[i]->count, rules[i]->count, symname(rules[i]->name));
+	}
+	free(rules);
+	free(stats.rule);
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* returns whether the whole output of an edge's job is needed in memory, to
+ * be filtered by depsfilter */
+static bool
+keepoutput(struct edge *e)
+{
+	struct string *deptype;
+
+	deptype = edgevar(e, SYM_DEPS, true);
+	return deptype && strcmp(deptype->s, "msvc") == 0;
+}
+
+static FILE *
+spillfile(void)
+{
+	FILE *f;
+#ifdef HAVE_MEMFD
+	int fd;
+
+	fd = memfd_create("samu-output", MFD_CLOEXEC);
+	if (fd < 0) {
+		warn("memfd_create:");
+		return NULL;
+	}
+	f = fdopen(fd, "w+");
+	if (!f) {
+		warn("fdopen:");
+		close(fd);
+	}
+#else
+	f = tmpfile();
+	if (!f) {
+		warn("tmpfile:");
+		return NULL;
+	}
+	if (fcntl(fileno(f), F_SETFD, FD_CLOEXEC) != 0) {
+		warn("fcntl CLOEXEC:");
+		fclose(f);
+		return NULL;
+	}
+#endif
+	return f;
+}
+
+/* move the buffered output of a job to its spill file */
+static int
+spill(struct job *j)
+{
+	if (!j->spill) {
+		j->spill = spillfile();
+		if (!j->spill)
+			return -1;
+	}
+	if (fwrite(j->buf.data, 1, j->buf.len, j->spill) != j->buf.len) {
+		warn("write job output:");
+		return -1;
+	}
+	if (j->buf.len)
+		j->spilllast = j->buf.data[j->buf.len - 1];
+	j->buf.len = 0;
+
+	return 0;
+}
+
+/* write the output in a spill file to stdout */
+static void
+replay(FILE *f)
+{
+	char buf[BUFSIZ];
+	size_t n;
+	off_t off = 0;
+#ifdef HAVE_MEMFD
+	ssize_t ret;
+#endif
+
+	if (fflush(f) != 0) {
+		warn("write job output:");
+		return;
+	}
+	fflush(stdout);
+#ifdef HAVE_MEMFD
+	for (;;) {
+		ret = sendfile(STDOUT_FILENO, fileno(f), &off, 1 << 30);
+		if (ret > 0)
+			continue;
+		if (ret == 0)
+			return;
+		if (errno == EINTR)
+			continue;
+		/* stdout may not support sendfile, so copy the rest */
+		if (errno != EINVAL && errno != ENOSYS) {
+			warn("sendfile:");
+			return;
+		}
+		break;
+	}
+#endif
+	if (fseeko(f, off, SEEK_SET) != 0) {
+		warn("seek job output:");
+		return;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		fwrite(buf, 1, n, stdout);
+	if (ferror(f))
+		warn("read job output:");
+}
+
 static void
 jobdone(struct job *j)
 {
 	int status;
+	pid_t ret;
 	struct edge *e, *new;
 	struct pool *p;
+	struct cgroupusage usage;
+	uint64_t rss = 0, end;
+	size_t i;
+	char last;
+#ifdef HAVE_WAIT4
+	struct rusage ru;
+#endif
 
 	++nfinished;
-	if (waitpid(j->pid, &status, 0) < 0) {
+	--nrunning;
+	end = elapsed();
+	statsjob(j->edge, end - j->start);
+	runstart -= j->start;
+	runtime -= j->estimate;
+	donetime += j->estimate;
+	statusdirty = true;
+	if (j->worker) {
+		if (j->status > 0) {
+			endstatus();
+			warn("job failed with status %d: %s", j->status, j->cmd->s);
+			j->failed = true;
+		}
+		workerrelease(j->worker, j->status >= 0);
+		j->worker = NULL;
+		goto output;
+	}
+#ifdef HAVE_WAIT4
+	ret = wait4(j->pid, &status, 0, &ru);
+#else
+	ret = waitpid(j->pid, &status, 0);
+#endif
+	/* messages about the job go below the status line */
+	if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		endstatus();
+	if (ret < 0) {
 		warn("waitpid %d:", j->pid);
 		j->failed = true;
 	} else if (WIFEXITED(status)) {
@@ -448,28 +1225,71 @@ jobdone(struct job *j)
 		warn("job status unknown: %s", j->cmd->s);
 		j->failed = true;
 	}
+#ifdef HAVE_WAIT4
+#ifdef __APPLE__
+	rss = ru.ru_maxrss / 1024;
+#else
+	rss = ru.ru_maxrss;
+#endif
+#endif
+	if (j->cgroup) {
+		cgroupdone(j->cgroup, &usage);
+		if (usage.oomkilled) {
+			endstatus();
+			warn("job ran out of memory: %s", j->cmd->s);
+		}
+		/* unlike wait4, this counts every process of the job together */
+		if (usage.maxrss)
+			rss = usage.maxrss;
+	}
 	close(j->fd);
-	if (j->buf.len && (!consoleused || j->failed))
-		fwrite(j->buf.data, 1, j->buf.len, stdout);
+output:
+	depsfilter(j->edge, &j->buf);
+	if ((j->buf.len || j->spill) && (!consoleused || j->failed)) {
+		endstatus();
+		last = j->buf.len ? j->buf.data[j->buf.len - 1] : j->spilllast;
+		if (j->spill) {
+			if (spill(j) == 0)
+				replay(j->spill);
+		} else {
+			fwrite(j->buf.data, 1, j->buf.len, stdout);
+		}
+		/* the status line is drawn from the start of the line */
+		if (smartterm && last != '\n')
+			putchar('\n');
+	}
 	j->buf.len = 0;
+	if (j->spill) {
+		fclose(j->spill);
+		j->spill = NULL;
+	}
 	e = j->edge;
 	if (e->pool) {
 		p = e->pool;
 
 		if (p == &consolepool)
 			consoleused = false;
-		/* move edge from pool queue to main work queue */
-		if (p->work) {
+		/* move edges from pool queue to main work queue while
+		 * there are enough free slots in the pool */
+		p->numjobs -= e->weight;
+		while (p->work && p->numjobs + p->work->weight <= (size_t)p->maxjobs) {
 			new = p->work;
 			p->work = p->work->worknext;
+			p->numjobs += new->weight;
+			--npoolwait;
 			new->worknext = work;
 			work = new;
-		} else {
-			--p->numjobs;
 		}
 	}
-	if (!j->failed)
+	if (!j->failed && buildopts.maxmem && rss)
+		rssrecord(e, rss);
+	if (!j->failed) {
+		for (i = 0; i < e->nout; ++i) {
+			e->out[i]->logstart = j->start;
+			e->out[i]->logend = end;
+		}
 		edgedone(e);
+	}
 }
 
 /* returns whether a job still has work to do. if not, sets j->failed */
@@ -481,26 +1301,49 @@ jobwork(struct job *j)
 	ssize_t n;
 
 	if (j->buf.cap - j->buf.len < BUFSIZ / 2) {
-		newcap = j->buf.cap + BUFSIZ;
-		newdata = realloc(j->buf.data, newcap);
-		if (!newdata) {
-			warn("realloc:");
-			goto kill;
+		if (j->buf.cap >= SPILLSIZE && !j->worker && !keepoutput(j->edge)) {
+			if (spill(j) < 0)
+				goto kill;
+		} else {
+			newcap = j->buf.cap ? j->buf.cap * 2 : BUFSIZ;
+			newdata = realloc(j->buf.data, newcap);
+			if (!newdata) {
+				warn("realloc:");
+				goto kill;
+			}
+			j->buf.cap = newcap;
+			j->buf.data = newdata;
 		}
-		j->buf.cap = newcap;
-		j->buf.data = newdata;
 	}
 	n = read(j->fd, j->buf.data + j->buf.len, j->buf.cap - j->buf.len);
 	if (n > 0) {
 		j->buf.len += n;
-		return true;
+		if (!j->worker)
+			return true;
+		switch (workerresponse(&j->buf, &j->status)) {
+		case 0:
+			return true;
+		case 1:
+			goto done;
+		}
+		endstatus();
+		warn("invalid response from worker: %s", j->cmd->s);
+		goto kill;
 	}
-	if (n == 0)
+	if (n == 0) {
+		if (!j->worker)
+			goto done;
+		endstatus();
+		warn("worker exited during job: %s", j->cmd->s);
+		j->status = -1;
+		j->failed = true;
 		goto done;
+	}
 	warn("read:");
 
 kill:
 	kill(j->pid, SIGTERM);
+	j->status = -1;
 	j->failed = true;
 done:
 	jobdone(j);
@@ -526,6 +1369,83 @@ queryload(void)
 #endif
 }
 
+/* queries the percentage of time some tasks were stalled on the CPU, memory,
+ * or I/O over the last 10 seconds, whichever is highest */
+static double
+querypressure(void)
+{
+	static const char *const files[] = {
+		"/proc/pressure/cpu",
+		"/proc/pressure/memory",
+		"/proc/pressure/io",
+	};
+	FILE *f;
+	double pressure, max;
+	size_t i;
+
+	max = 0;
+	for (i = 0; i < countof(files); ++i) {
+		f = fopen(files[i], "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "some avg10=%lf", &pressure) == 1 && pressure > max)
+			max = pressure;
+		fclose(f);
+	}
+
+	return max;
+}
+
+/* whether the system is busier than allowed by -l or -p */
+static bool
+overloaded(void)
+{
+	if (buildopts.maxload && queryload() > buildopts.maxload)
+		return true;
+	if (buildopts.maxpressure && querypressure() > buildopts.maxpressure)
+		return true;
+	return false;
+}
+
+/* move the job limit by one toward what the system can take, at most once
+ * a second, so that it doesn't oscillate */
+static size_t
+limitjobs(size_t maxjobs)
+{
+	static struct timespec last;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((int64_t)(now.tv_sec - last.tv_sec) * 1000000000 + now.tv_nsec - last.tv_nsec < 1000000000)
+		return maxjobs;
+	last = now;
+	if (overloaded()) {
+		if (maxjobs > 1)
+			--maxjobs;
+	} else if (maxjobs < buildopts.maxjobs) {
+		++maxjobs;
+	}
+
+	return maxjobs;
+}
+
+/* take the first edge from the work queue whose job fits in the given number
+ * of job slots and is expected to need no more than the given amount of memory */
+static struct edge *
+takework(size_t slotsleft, uint64_t memleft)
+{
+	struct edge **e, *ret;
+
+	for (e = &work; *e; e = &(*e)->worknext) {
+		ret = *e;
+		if (ret->rule == &phonyrule || buildopts.dryrun || (ret->weight <= slotsleft && rssexpect(ret) <= memleft)) {
+			*e = ret->worknext;
+			return ret;
+		}
+	}
+	return NULL;
+}
+
 static void
 catchsig(int sig)
 {
@@ -543,11 +1463,15 @@ build(void)
 	};
 	struct job *jobs = NULL;
 	struct pollfd *fds = NULL;
-	size_t i, next = 0, jobslen = 0, maxjobs = buildopts.maxjobs, numjobs = 0, numfail = 0;
+	size_t i, next = 0, jobslen = 0, maxjobs = buildopts.maxjobs, numjobs = 0, numslots = 0, numfail = 0;
 	struct edge *e;
 	struct sigaction sa;
-	int sig;
+	int sig, timeout;
 	ssize_t ret;
+	bool limited;
+	enum idlecause cause;
+	const char *term;
+	uint64_t memused = 0;
 
 	if (ntotal == 0) {
 		warn("nothing to do");
@@ -567,21 +1491,42 @@ build(void)
 	}
 
 	clock_gettime(CLOCK_MONOTONIC, &starttime);
+	avgtime = nknown ? knowntime / nknown : 0;
+	totaltime = knowntime + (ntotal - nknown) * avgtime;
+	donetime = 0;
+	jobslimit = buildopts.maxjobs;
 	formatstatus(NULL, 0);
+	term = getenv("TERM");
+	smartterm = !buildopts.verbose && isatty(STDOUT_FILENO) && term && strcmp(term, "dumb") != 0;
+	statusedge = NULL;
+	statusdirty = false;
 
+	limited = buildopts.maxload || buildopts.maxpressure;
+	if (limited)
+		maxjobs = overloaded() ? 1 : buildopts.maxjobs;
 	nstarted = 0;
 	for (;;) {
 		/* limit number of of jobs based on load */
-		if (buildopts.maxload)
-			maxjobs = queryload() > buildopts.maxload ? 1 : buildopts.maxjobs;
-		/* start ready edges */
-		while (work && numjobs < maxjobs && numfail < buildopts.maxfail) {
-			e = work;
-			work = work->worknext;
+		if (limited)
+			maxjobs = limitjobs(maxjobs);
+		jobslimit = maxjobs;
+		/* start ready edges, skipping over jobs that would exceed the
+		 * job slots or memory budget, unless there is nothing else
+		 * running */
+		while (work && numslots < maxjobs && numfail < buildopts.maxfail) {
+			if (numjobs == 0)
+				e = takework(SIZE_MAX, UINT64_MAX);
+			else if (!buildopts.maxmem)
+				e = takework(maxjobs - numslots, UINT64_MAX);
+			else
+				e = takework(maxjobs - numslots, memused < buildopts.maxmem ? buildopts.maxmem - memused : 0);
+			if (!e)
+				break;
 			if (e->rule != &phonyrule && buildopts.dryrun) {
 				++nstarted;
-				printstatus(e, edgevar(e, "command", true));
+				printstatus(e, edgevar(e, SYM_COMMAND, true));
 				++nfinished;
+				donetime += estimate(e);
 			}
 			if (e->rule == &phonyrule || buildopts.dryrun) {
 				for (i = 0; i < e->nout; ++i)
@@ -598,6 +1543,7 @@ build(void)
 					jobs[i].buf.data = NULL;
 					jobs[i].buf.len = 0;
 					jobs[i].buf.cap = 0;
+					jobs[i].spill = NULL;
 					jobs[i].next = i + 1;
 					fds[i].fd = -1;
 					fds[i].events = POLLIN;
@@ -610,14 +1556,33 @@ build(void)
 				warn("job failed to start");
 				++numfail;
 			} else {
+				jobs[next].rss = buildopts.maxmem ? rssexpect(e) : 0;
+				memused += jobs[next].rss;
+				jobs[next].weight = e->weight;
+				numslots += e->weight;
 				next = jobs[next].next;
 				++numjobs;
 			}
 		}
 		if (numjobs == 0)
 			break;
+		if (numslots >= buildopts.maxjobs || numfail >= buildopts.maxfail)
+			cause = IDLE_NONE;
+		else if (work && numslots >= maxjobs)
+			cause = IDLE_LOAD;
+		else if (work)
+			cause = IDLE_MEMORY;
+		else if (npoolwait > 0)
+			cause = IDLE_POOL;
+		else
+			cause = IDLE_DEPS;
+		statsupdate(numjobs, numslots, cause);
+		refreshstatus(false);
+		timeout = limited ? 1000 : 5000;
+		if (statusdirty && statusedge)
+			timeout = REFRESHMS;
 		for (;;) {
-			if (poll(fds, jobslen + 1, 5000) >= 0)
+			if (poll(fds, jobslen + 1, timeout) >= 0)
 				break;
 			if (errno != EINTR)
 				fatal("poll:");
@@ -628,6 +1593,7 @@ build(void)
 				fatal("read signal:");
 			if (ret != sizeof sig)
 				fatal("read signal: unexpected size");
+			endstatus();
 			warn("received signal: %s", strsignal(sig));
 			for (i = 0; i < jobslen; ++i) {
 				if (fds[i].fd != -1)
@@ -643,6 +1609,8 @@ build(void)
 			if (!fds[i].revents || jobwork(&jobs[i]))
 				continue;
 			--numjobs;
+			numslots -= jobs[i].weight;
+			memused -= jobs[i].rss;
 			jobs[i].next = next;
 			fds[i].fd = -1;
 			next = i;
@@ -650,6 +1618,9 @@ build(void)
 				++numfail;
 		}
 	}
+	endstatus();
+	if (buildopts.stats)
+		printstats();
 	for (i = 0; i < jobslen; ++i)
 		free(jobs[i].buf.data);
 	free(jobs);
@@ -662,5 +1633,8 @@ build(void)
 		else
 			fatal("subcommand failed");
 	}
-	ntotal = 0;  /* reset in case we just rebuilt the manifest */
+	/* reset in case we just rebuilt the manifest */
+	ntotal = 0;
+	knowntime = 0;
+	nknown = 0;
 }
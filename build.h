@@ -1,10 +1,16 @@
+#include <stdint.h>  /* for uint64_t */
+
 struct node;
 
 struct buildoptions {
 	size_t maxjobs, maxfail;
-	_Bool verbose, explain, keepdepfile, keeprsp, dryrun;
+	_Bool verbose, explain, keepdepfile, keeprsp, dryrun, statcache, stats;
 	const char *statusfmt;
-	double maxload;
+	/* cgroup v2 directory to run jobs in, or NULL */
+	const char *cgroup;
+	double maxload, maxpressure;
+	/* memory budget for running jobs in KiB */
+	uint64_t maxmem;
 };
 
 extern struct buildoptions buildopts;
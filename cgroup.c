@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cgroup.h"
+#include "env.h"
+#include "graph.h"
+#include "util.h"
+
+/*
+The build runs in a cgroup named samu.PID, created in the cgroup v2 directory
+given to cgroupinit. Jobs of edges in a pool run in a cgroup for the pool
+named pool.NAME, and other jobs run directly in the build's cgroup. Each job
+gets a cgroup of its own named job.N, which is removed when it finishes.
+*/
+
+struct cgroup {
+	int parent, fd;
+	char name[32];
+};
+
+static int rootfd = -1, buildfd = -1;
+static char *buildname;
+/* descriptors for the cgroups of the pools, indexed by pool name */
+static int *poolfd;
+static size_t poolfdlen;
+static unsigned long njobs;
+
+static int
+writeat(int dirfd, const char *name, const char *s)
+{
+	size_t len;
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = strlen(s);
+	ret = write(fd, s, len);
+	close(fd);
+
+	return ret == (ssize_t)len ? 0 : -1;
+}
+
+/* read a small file, returning false if it is missing or empty */
+static bool
+readat(int dirfd, const char *name, char *buf, size_t len)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return false;
+	buf[ret] = '\0';
+
+	return true;
+}
+
+/* let the children of a cgroup be limited and accounted for. this fails if
+ * the controllers are not available, in which case jobs just go without */
+static void
+enable(int fd)
+{
+	writeat(fd, "cgroup.subtree_control", "+cpu");
+	writeat(fd, "cgroup.subtree_control", "+memory");
+}
+
+static int
+mkcgroup(int dirfd, const char *name)
+{
+	int fd;
+
+	if (mkdirat(dirfd, name, 0777) < 0 && errno != EEXIST)
+		return -1;
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		unlinkat(dirfd, name, AT_REMOVEDIR);
+	return fd;
+}
+
+static void
+rmcgroup(int dirfd, const char *name)
+{
+	/* a cgroup still holds processes that a job left running in the
+	 * background, so it is left for them */
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) < 0 && errno != EBUSY && errno != ENOENT)
+		warn("rmdir %s:", name);
+}
+
+static void
+closepools(void)
+{
+	char *name;
+	size_t i;
+
+	for (i = 0; i < poolfdlen; ++i) {
+		if (poolfd[i] == -1)
+			continue;
+		close(poolfd[i]);
+		poolfd[i] = -1;
+		xasprintf(&name, "pool.%s", symname(i));
+		rmcgroup(buildfd, name);
+		free(name);
+	}
+}
+
+void
+cgroupinit(const char *dir)
+{
+	if (buildfd != -1) {
+		/* the pools may have changed with the manifest */
+		closepools();
+		return;
+	}
+	rootfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0)
+		fatal("open %s:", dir);
+	enable(rootfd);
+	xasprintf(&buildname, "samu.%ld", (long)getpid());
+	buildfd = mkcgroup(rootfd, buildname);
+	if (buildfd < 0)
+		fatal("mkdir %s/%s:", dir, buildname);
+	enable(buildfd);
+}
+
+void
+cgroupclose(void)
+{
+	if (buildfd == -1)
+		return;
+	closepools();
+	close(buildfd);
+	buildfd = -1;
+	rmcgroup(rootfd, buildname);
+	close(rootfd);
+	rootfd = -1;
+	free(buildname);
+}
+
+static int
+poolcgroup(struct pool *p)
+{
+	char *name;
+	size_t len;
+	int fd;
+
+	if (!p)
+		return buildfd;
+	if ((size_t)p->name >= poolfdlen) {
+		len = poolfdlen ? poolfdlen : 16;
+		while (len <= (size_t)p->name)
+			len *= 2;
+		poolfd = xreallocarray(poolfd, len, sizeof(poolfd[0]));
+		for (; poolfdlen < len; ++poolfdlen)
+			poolfd[poolfdlen] = -1;
+	}
+	if (poolfd[p->name] != -1)
+		return poolfd[p->name];
+	xasprintf(&name, "pool.%s", symname(p->name));
+	fd = mkcgroup(buildfd, name);
+	if (fd < 0) {
+		warn("mkdir %s:", name);
+		free(name);
+		return buildfd;
+	}
+	enable(fd);
+	if (p->cpuweight && writeat(fd, "cpu.weight", p->cpuweight->s) < 0)
+		warn("set cpu.weight of %s:", name);
+	if (p->memorymax && writeat(fd, "memory.max", p->memorymax->s) < 0)
+		warn("set memory.max of %s:", name);
+	free(name);
+	poolfd[p->name] = fd;
+
+	return fd;
+}
+
+struct cgroup *
+cgroupjob(struct edge *e)
+{
+	struct cgroup *cg;
+
+	if (buildfd == -1)
+		return NULL;
+	cg = xmalloc(sizeof(*cg));
+	cg->parent = poolcgroup(e->pool);
+	snprintf(cg->name, sizeof(cg->name), "job.%lu", ++njobs);
+	cg->fd = mkcgroup(cg->parent, cg->name);
+	if (cg->fd < 0) {
+		warn("mkdir %s:", cg->name);
+		free(cg);
+		return NULL;
+	}
+
+	return cg;
+}
+
+int
+cgroupfd(struct cgroup *cg)
+{
+	return cg->fd;
+}
+
+void
+cgroupdone(struct cgroup *cg, struct cgroupusage *usage)
+{
+	char buf[1024], *s;
+
+	usage->maxrss = 0;
+	usage->oomkilled = false;
+	if (readat(cg->fd, "memory.peak", buf, sizeof(buf)))
+		usage->maxrss = strtoull(buf, NULL, 10) / 1024;
+	if (readat(cg->fd, "memory.events", buf, sizeof(buf))) {
+		s = strstr(buf, "oom_kill ");
+		if (s && (s == buf || s[-1] == '\n'))
+			usage->oomkilled = strtoull(s + 9, NULL, 10) > 0;
+	}
+	close(cg->fd);
+	rmcgroup(cg->parent, cg->name);
+	free(cg);
+}
@@ -0,0 +1,25 @@
+#include <stdint.h>  /* for uint64_t */
+
+struct edge;
+struct cgroup;
+
+/* resource use of a finished job, as accounted by its cgroup */
+struct cgroupusage {
+	/* peak memory use in KiB of all of the job's processes, or 0 if not known */
+	uint64_t maxrss;
+	/* whether a process was killed for exceeding the memory limit of the pool */
+	_Bool oomkilled;
+};
+
+/* create a cgroup for the build in the given cgroup v2 directory, with a
+ * child cgroup for each pool */
+void cgroupinit(const char *);
+/* remove the cgroups of the build */
+void cgroupclose(void);
+/* create a cgroup for a job of an edge, or return NULL if the build does not
+ * run jobs in cgroups */
+struct cgroup *cgroupjob(struct edge *);
+/* a directory descriptor for the cgroup, to start the job in */
+int cgroupfd(struct cgroup *);
+/* read the resource use of a finished job, then remove its cgroup */
+void cgroupdone(struct cgroup *, struct cgroupusage *);
@@ -9,6 +9,7 @@
 #include "deps.h"
 #include "env.h"
 #include "graph.h"
+#include "os.h"
 #include "util.h"
 
 /*
@@ -60,32 +61,93 @@ static const uint32_t depsver = 4;
 static FILE *depsfile;
 static struct entry *entries;
 static size_t entrieslen, entriescap;
+/* dependencies parsed from the output of the last job with deps = msvc */
+static struct nodearray msvcdeps;
+static size_t msvcdepscap;
 
+/* entries kept while the manifest is reloaded, with their nodes by path and
+ * dependencies by ID */
+static struct {
+	bool valid;
+	char *builddir;
+	struct string **path;
+	uint64_t *hash;
+	int32_t **deps;
+} saved;
+
+/* dependency records of outputs that are not built with deps in the graph,
+ * kept by ID in case the manifest is regenerated. these are not in a
+ * compacted log, so they are dropped when compaction starts and none are
+ * kept while it runs */
+static struct rawdeps {
+	int32_t id;
+	int64_t mtime;
+	int32_t *deps;
+	size_t len;
+} *kept;
+static size_t keptlen, keptcap;
+
+/* background compaction of the deps log */
+static struct {
+	pid_t pid;
+	/* new IDs of the nodes known when compaction started */
+	int32_t *id;
+	/* room for applyids in the child */
+	struct entry *old;
+	size_t len, newlen;
+	/* nodes whose dependencies were recorded since compaction started */
+	struct nodearray pending;
+	size_t pendingcap;
+	char *path, *tmppath;
+} compact = {.pid = -1};
+
+/* write errors are left for the caller to find with ferror, since this
+ * also runs in the compaction child, which must not exit with fatal */
 static void
 depswrite(const void *p, size_t n, size_t m)
 {
-	if (fwrite(p, n, m, depsfile) != m)
-		fatal("deps log write:");
+	fwrite(p, n, m, depsfile);
 }
 
+/* assign the next ID to a node, returning false if it already has one */
 static bool
-recordid(struct node *n)
+addid(struct node *n)
 {
-	uint32_t sz, chk;
-
 	if (n->id != -1)
 		return false;
 	if (entrieslen == INT32_MAX)
 		fatal("too many nodes");
-	n->id = entrieslen++;
+	if (entrieslen == entriescap) {
+		entriescap = entriescap ? entriescap * 2 : 1024;
+		entries = xreallocarray(entries, entriescap, sizeof(entries[0]));
+	}
+	n->id = entrieslen;
+	entries[entrieslen++] = (struct entry){.node = n};
+
+	return true;
+}
+
+static void
+writeid(struct node *n)
+{
+	uint32_t sz, chk;
+
 	sz = (n->path->n + 7) & ~3;
-	if (sz + 4 >= MAX_RECORD_SIZE)
-		fatal("ID record too large");
 	depswrite(&sz, 4, 1);
 	depswrite(n->path->s, 1, n->path->n);
 	depswrite((char[4]){0}, 1, sz - n->path->n - 4);
 	chk = ~n->id;
 	depswrite(&chk, 4, 1);
+}
+
+static bool
+recordid(struct node *n)
+{
+	if (!addid(n))
+		return false;
+	if (((n->path->n + 7) & ~3) + 4 >= MAX_RECORD_SIZE)
+		fatal("ID record too large");
+	writeid(n);
 
 	return true;
 }
@@ -97,8 +159,6 @@ recorddeps(struct node *out, struct nodearray *deps, int64_t mtime)
 	size_t i;
 
 	sz = 12 + deps->len * 4;
-	if (sz + 4 >= MAX_RECORD_SIZE)
-		fatal("deps record too large");
 	sz |= 0x80000000;
 	depswrite(&sz, 4, 1);
 	depswrite(&out->id, 4, 1);
@@ -110,24 +170,268 @@ recorddeps(struct node *out, struct nodearray *deps, int64_t mtime)
 		depswrite(&deps->node[i]->id, 4, 1);
 }
 
+/* compute new IDs for a log containing only the nodes with dependency
+ * records and the nodes they refer to, returning the number of nodes */
+static size_t
+compactids(int32_t *id)
+{
+	struct entry *entry;
+	size_t i, j, n;
+	int32_t k;
+
+	for (i = 0; i < entrieslen; ++i)
+		id[i] = -1;
+	n = 0;
+	for (i = 0; i < entrieslen; ++i) {
+		entry = &entries[i];
+		if (!entry->deps.len)
+			continue;
+		if (id[i] == -1)
+			id[i] = n++;
+		for (j = 0; j < entry->deps.len; ++j) {
+			k = entry->deps.node[j]->id;
+			if (id[k] == -1)
+				id[k] = n++;
+		}
+	}
+
+	return n;
+}
+
+/* renumber the first len entries using the IDs from compactids, dropping
+ * the rest. old must have room for all the entries, so that nothing is
+ * allocated in the compaction child */
+static void
+applyids(const int32_t *id, size_t len, size_t newlen, struct entry *old)
+{
+	size_t i;
+
+	if (entrieslen == 0)
+		return;
+	memcpy(old, entries, entrieslen * sizeof(entries[0]));
+	for (i = 0; i < entrieslen; ++i)
+		old[i].node->id = i < len ? id[i] : -1;
+	for (i = 0; i < len; ++i) {
+		if (id[i] != -1)
+			entries[id[i]] = old[i];
+	}
+	entrieslen = newlen;
+}
+
+/* write the header, followed by a record for every entry */
+static void
+writeall(void)
+{
+	struct entry *entry;
+	size_t i;
+
+	depswrite(depsheader, 1, sizeof(depsheader) - 1);
+	depswrite(&depsver, 1, sizeof(depsver));
+	for (i = 0; i < entrieslen; ++i)
+		writeid(entries[i].node);
+	for (i = 0; i < entrieslen; ++i) {
+		entry = &entries[i];
+		if (entry->deps.len)
+			recorddeps(entry->node, &entry->deps, entry->mtime);
+	}
+}
+
+/* runs in a child process to write a compacted log */
+static int
+depscompact(void)
+{
+	depsfile = fopen(compact.tmppath, "w");
+	if (!depsfile) {
+		warn("open %s:", compact.tmppath);
+		return 1;
+	}
+	applyids(compact.id, compact.len, compact.newlen, compact.old);
+	writeall();
+	if (fflush(depsfile) != 0 || ferror(depsfile)) {
+		warn("deps log write failed");
+		return 1;
+	}
+	if (fclose(depsfile) != 0) {
+		warn("deps log write:");
+		return 1;
+	}
+	return 0;
+}
+
+/* finish background compaction, replaying records appended to the old
+ * log into the new one before swapping it into place */
+static void
+compactdone(void)
+{
+	struct entry *pending, *old;
+	struct node *n;
+	size_t i, j;
+
+	if (!oswait(compact.pid)) {
+		warn("deps log compaction failed");
+		remove(compact.tmppath);
+		goto done;
+	}
+	pending = xreallocarray(NULL, compact.pending.len, sizeof(pending[0]));
+	for (i = 0; i < compact.pending.len; ++i)
+		pending[i] = entries[compact.pending.node[i]->id];
+	old = xreallocarray(NULL, entrieslen, sizeof(old[0]));
+	applyids(compact.id, compact.len, compact.newlen, old);
+	free(old);
+	fclose(depsfile);
+	depsfile = fopen(compact.tmppath, "a");
+	if (!depsfile)
+		fatal("open %s:", compact.tmppath);
+	for (i = 0; i < compact.pending.len; ++i) {
+		n = pending[i].node;
+		recordid(n);
+		for (j = 0; j < pending[i].deps.len; ++j)
+			recordid(pending[i].deps.node[j]);
+		recorddeps(n, &pending[i].deps, pending[i].mtime);
+		entries[n->id] = pending[i];
+	}
+	free(pending);
+	fflush(depsfile);
+	if (ferror(depsfile))
+		fatal("deps log write failed");
+	if (rename(compact.tmppath, compact.path) < 0)
+		fatal("deps log rename:");
+
+done:
+	compact.pid = -1;
+	compact.pending.len = 0;
+	free(compact.id);
+	if (compact.path != depsname) {
+		free(compact.path);
+		free(compact.tmppath);
+	}
+}
+
+static void
+keep(int32_t id, int64_t mtime, int32_t *deps, size_t len)
+{
+	if (keptlen == keptcap) {
+		keptcap = keptcap ? keptcap * 2 : 64;
+		kept = xreallocarray(kept, keptcap, sizeof(kept[0]));
+	}
+	kept[keptlen++] = (struct rawdeps){id, mtime, deps, len};
+}
+
+static void
+dropkept(void)
+{
+	size_t i;
+
+	for (i = 0; i < keptlen; ++i)
+		free(kept[i].deps);
+	keptlen = 0;
+}
+
+/* set the dependencies of an entry from a list of IDs */
+static void
+setdeps(struct entry *entry, const int32_t *deps, size_t len, int64_t mtime)
+{
+	size_t i;
+
+	free(entry->deps.node);
+	entry->deps.node = xreallocarray(NULL, len, sizeof(entry->deps.node[0]));
+	for (i = 0; i < len; ++i)
+		entry->deps.node[i] = entries[deps[i]].node;
+	entry->deps.len = len;
+	entry->mtime = mtime;
+}
+
+static bool
+builtwithdeps(struct node *n)
+{
+	return n->gen && edgevar(n->gen, SYM_DEPS, true);
+}
+
+/* attach the saved entries and kept records to the nodes of the new graph,
+ * if requested, and discard them */
+static void
+depsrestore(bool apply)
+{
+	struct entry *entry;
+	struct rawdeps *r;
+	struct node *n;
+	size_t i, len;
+
+	len = entrieslen;
+	for (i = 0; i < len; ++i) {
+		if (!apply) {
+			free(saved.path[i]);
+			free(saved.deps[i]);
+			continue;
+		}
+		/* IDs stay the same, so they still match the log */
+		n = mknodehash(saved.path[i], saved.hash[i]);
+		n->id = i;
+		entries[i].node = n;
+	}
+	if (!apply) {
+		entrieslen = 0;
+		dropkept();
+	}
+	for (i = 0; apply && i < len; ++i) {
+		entry = &entries[i];
+		if (entry->deps.len > 0 && builtwithdeps(entry->node)) {
+			setdeps(entry, saved.deps[i], entry->deps.len, entry->mtime);
+			free(saved.deps[i]);
+		} else if (entry->deps.len > 0) {
+			keep(i, entry->mtime, saved.deps[i], entry->deps.len);
+			entry->deps.len = 0;
+			entry->mtime = 0;
+		}
+	}
+	len = 0;
+	for (i = 0; apply && i < keptlen; ++i) {
+		r = &kept[i];
+		if (builtwithdeps(entries[r->id].node)) {
+			setdeps(&entries[r->id], r->deps, r->len, r->mtime);
+			free(r->deps);
+		} else {
+			kept[len++] = *r;
+		}
+	}
+	if (apply)
+		keptlen = len;
+	free(saved.path);
+	free(saved.hash);
+	free(saved.deps);
+	free(saved.builddir);
+	memset(&saved, 0, sizeof(saved));
+}
+
 void
 depsinit(const char *builddir)
 {
 	char *depspath = (char *)depsname, *depstmppath = (char *)depstmpname;
 	uint32_t *buf, cap, ver, sz, id;
-	size_t len, i, j, nrecord;
+	size_t len, i, nrecord;
 	bool isdep;
 	struct string *path;
 	struct node *n;
-	struct edge *e;
-	struct entry *entry, *oldentries;
+	struct entry *entry, *old;
+	int32_t *newid, *raw;
 
 	/* XXX: when ninja hits a bad record, it truncates the log to the last
 	 * good record. perhaps we should do the same. */
 
+	if (saved.valid) {
+		/* the log is still open, so only the entries need to be restored */
+		if (builddir ? saved.builddir && strcmp(builddir, saved.builddir) == 0 : !saved.builddir) {
+			depsrestore(true);
+			return;
+		}
+		depsrestore(false);
+	}
 	if (depsfile)
-		fclose(depsfile);
+		depsclose();
+	for (i = 0; i < entrieslen; ++i)
+		free(entries[i].deps.node);
 	entrieslen = 0;
+	dropkept();
 	cap = BUFSIZ;
 	buf = xmalloc(cap);
 	if (builddir)
@@ -187,22 +491,20 @@ depsinit(const char *builddir)
 				goto rewrite;
 			}
 			entry = &entries[id];
-			entry->mtime = (int64_t)buf[2] << 32 | buf[1];
-			e = entry->node->gen;
-			if (!e || !edgevar(e, "deps", true))
-				continue;
 			sz /= 4;
-			free(entry->deps.node);
-			entry->deps.len = sz;
-			entry->deps.node = xreallocarray(NULL, sz, sizeof(n));
 			for (i = 0; i < sz; ++i) {
-				id = buf[3 + i];
-				if (id >= entrieslen) {
-					warn("invalid node ID: %" PRIu32, id);
+				if (buf[3 + i] >= entrieslen) {
+					warn("invalid node ID: %" PRIu32, buf[3 + i]);
 					goto rewrite;
 				}
-				entry->deps.node[i] = entries[id].node;
 			}
+			if (!builtwithdeps(entry->node)) {
+				raw = xreallocarray(NULL, sz, sizeof(raw[0]));
+				memcpy(raw, buf + 3, sz * sizeof(raw[0]));
+				keep(id, (int64_t)buf[2] << 32 | buf[1], raw, sz);
+				continue;
+			}
+			setdeps(entry, (int32_t *)buf + 3, sz, (int64_t)buf[2] << 32 | buf[1]);
 		} else {
 			if (sz <= 4) {
 				warn("invalid size, must be greater than 4: %" PRIu32, sz);
@@ -224,57 +526,58 @@ depsinit(const char *builddir)
 			path->s[len] = '\0';
 
 			n = mknode(path);
-			if (entrieslen >= entriescap) {
-				entriescap = entriescap ? entriescap * 2 : 1024;
-				entries = xreallocarray(entries, entriescap, sizeof(entries[0]));
-			}
-			n->id = entrieslen;
-			entries[entrieslen++] = (struct entry){.node = n};
+			n->id = -1;
+			addid(n);
 		}
 	}
 	if (ferror(depsfile)) {
 		warn("deps log read:");
 		goto rewrite;
 	}
+	free(buf);
 	if (nrecord <= 1000 || nrecord < 3 * entrieslen) {
 		if (builddir)
 			free(depspath);
-		free(buf);
 		return;
 	}
 
+	/* the log is valid, so keep appending to it while a compacted copy
+	 * is written in the background */
+	dropkept();
+	if (builddir)
+		xasprintf(&depstmppath, "%s/%s", builddir, depstmpname);
+	compact.path = depspath;
+	compact.tmppath = depstmppath;
+	compact.len = entrieslen;
+	compact.id = xreallocarray(NULL, entrieslen, sizeof(compact.id[0]));
+	compact.newlen = compactids(compact.id);
+	compact.old = xreallocarray(NULL, entrieslen, sizeof(compact.old[0]));
+	if (fseek(depsfile, 0, SEEK_END) == 0)
+		compact.pid = osfork(depscompact);
+	free(compact.old);
+	if (compact.pid != -1)
+		return;
+	warn("failed to start deps log compaction");
+	free(compact.id);
+	goto write;
+
 rewrite:
 	free(buf);
-	if (depsfile)
-		fclose(depsfile);
 	if (builddir)
 		xasprintf(&depstmppath, "%s/%s", builddir, depstmpname);
+write:
+	dropkept();
+	if (depsfile)
+		fclose(depsfile);
 	depsfile = fopen(depstmppath, "w");
 	if (!depsfile)
 		fatal("open %s:", depstmppath);
-	depswrite(depsheader, 1, sizeof(depsheader) - 1);
-	depswrite(&depsver, 1, sizeof(depsver));
-
-	/* reset ID for all current entries */
-	for (i = 0; i < entrieslen; ++i)
-		entries[i].node->id = -1;
-	/* save a temporary copy of the old entries */
-	oldentries = xreallocarray(NULL, entrieslen, sizeof(entries[0]));
-	memcpy(oldentries, entries, entrieslen * sizeof(entries[0]));
-
-	len = entrieslen;
-	entrieslen = 0;
-	for (i = 0; i < len; ++i) {
-		entry = &oldentries[i];
-		if (!entry->deps.len)
-			continue;
-		recordid(entry->node);
-		entries[entry->node->id] = *entry;
-		for (j = 0; j < entry->deps.len; ++j)
-			recordid(entry->deps.node[j]);
-		recorddeps(entry->node, &entry->deps, entry->mtime);
-	}
-	free(oldentries);
+	newid = xreallocarray(NULL, entrieslen, sizeof(newid[0]));
+	old = xreallocarray(NULL, entrieslen, sizeof(old[0]));
+	applyids(newid, entrieslen, compactids(newid), old);
+	free(newid);
+	free(old);
+	writeall();
 	fflush(depsfile);
 	if (ferror(depsfile))
 		fatal("deps log write failed");
@@ -292,7 +595,58 @@ depsclose(void)
 	fflush(depsfile);
 	if (ferror(depsfile))
 		fatal("deps log write failed");
+	if (compact.pid != -1)
+		compactdone();
 	fclose(depsfile);
+	depsfile = NULL;
+}
+
+void
+depssave(const char *builddir)
+{
+	struct entry *entry;
+	struct string *path;
+	size_t i, j;
+
+	/* compaction refers to the nodes, so finish it first */
+	if (compact.pid != -1)
+		compactdone();
+	saved.valid = true;
+	saved.builddir = builddir ? xmemdup(builddir, strlen(builddir) + 1) : NULL;
+	saved.path = xreallocarray(NULL, entrieslen ? entrieslen : 1, sizeof(saved.path[0]));
+	saved.hash = xreallocarray(NULL, entrieslen ? entrieslen : 1, sizeof(saved.hash[0]));
+	saved.deps = xreallocarray(NULL, entrieslen ? entrieslen : 1, sizeof(saved.deps[0]));
+	for (i = 0; i < entrieslen; ++i) {
+		entry = &entries[i];
+		path = mkstr(entry->node->path->n);
+		memcpy(path->s, entry->node->path->s, path->n + 1);
+		saved.path[i] = path;
+		saved.hash[i] = entry->node->pathhash;
+		saved.deps[i] = NULL;
+		if (entry->deps.len > 0) {
+			saved.deps[i] = xreallocarray(NULL, entry->deps.len, sizeof(saved.deps[i][0]));
+			for (j = 0; j < entry->deps.len; ++j)
+				saved.deps[i][j] = entry->deps.node[j]->id;
+		}
+		free(entry->deps.node);
+		entry->deps.node = NULL;
+		entry->node = NULL;
+	}
+}
+
+/* open the deps log for appending after it was loaded and closed */
+void
+depsreopen(const char *builddir)
+{
+	char *depspath = (char *)depsname;
+
+	if (builddir)
+		xasprintf(&depspath, "%s/%s", builddir, depsname);
+	depsfile = fopen(depspath, "a");
+	if (!depsfile)
+		fatal("open %s:", depspath);
+	if (builddir)
+		free(depspath);
 }
 
 static struct nodearray *
@@ -416,6 +770,75 @@ err:
 	return NULL;
 }
 
+void
+depsfilter(struct edge *e, struct buffer *buf)
+{
+	static const char defprefix[] = "Note: including file: ";
+	struct string *deptype, *prefix, *path;
+	const char *pre;
+	size_t prelen, i;
+	char *s, *t, *d, *end, *line, *next;
+	struct node *n;
+
+	deptype = edgevar(e, SYM_DEPS, true);
+	if (!deptype || strcmp(deptype->s, "msvc") != 0)
+		return;
+	prefix = edgevar(e, SYM_MSVC_DEPS_PREFIX, false);
+	if (prefix) {
+		pre = prefix->s;
+		prelen = prefix->n;
+	} else {
+		pre = defprefix;
+		prelen = sizeof(defprefix) - 1;
+	}
+	msvcdeps.len = 0;
+	if (buf->len == 0)
+		return;
+	d = buf->data;
+	end = buf->data + buf->len;
+	for (line = buf->data; line < end; line = next) {
+		s = memchr(line, '\n', end - line);
+		next = s ? s + 1 : end;
+		if ((size_t)(next - line) < prelen || memcmp(line, pre, prelen) != 0) {
+			memmove(d, line, next - line);
+			d += next - line;
+			continue;
+		}
+		for (s = line + prelen; s < next && isblank(*(unsigned char *)s); ++s)
+			;
+		for (t = next; t > s && isspace(*(unsigned char *)(t - 1)); --t)
+			;
+		if (s == t)
+			continue;
+		path = mkstr(t - s);
+		memcpy(path->s, s, path->n);
+		path->s[path->n] = '\0';
+		canonpath(path);
+		n = mknode(path);
+		for (i = 0; i < msvcdeps.len && msvcdeps.node[i] != n; ++i)
+			;
+		if (i < msvcdeps.len)
+			continue;
+		if (msvcdeps.len == msvcdepscap) {
+			msvcdepscap = msvcdepscap ? msvcdepscap * 2 : 32;
+			msvcdeps.node = xreallocarray(msvcdeps.node, msvcdepscap, sizeof(msvcdeps.node[0]));
+		}
+		msvcdeps.node[msvcdeps.len++] = n;
+	}
+	buf->len = d - buf->data;
+}
+
+struct node **
+depsrecorded(struct node *n, size_t *len)
+{
+	if (n->id == -1) {
+		*len = 0;
+		return NULL;
+	}
+	*len = entries[n->id].deps.len;
+	return entries[n->id].deps.node;
+}
+
 void
 depsload(struct edge *e)
 {
@@ -427,14 +850,14 @@ depsload(struct edge *e)
 		return;
 	e->flags |= FLAG_DEPS;
 	n = e->out[0];
-	deptype = edgevar(e, "deps", true);
+	deptype = edgevar(e, SYM_DEPS, true);
 	if (deptype) {
 		if (n->id != -1 && n->mtime <= entries[n->id].mtime)
 			deps = &entries[n->id].deps;
 		else if (buildopts.explain)
 			warn("explain %s: missing or outdated record in .ninja_deps", n->path->s);
 	} else {
-		depfile = edgevar(e, "depfile", false);
+		depfile = edgevar(e, SYM_DEPFILE, false);
 		if (!depfile)
 			return;
 		deps = depsparse(depfile->s, false);
@@ -459,26 +882,30 @@ depsrecord(struct edge *e)
 	size_t i;
 	bool update;
 
-	deptype = edgevar(e, "deps", true);
+	deptype = edgevar(e, SYM_DEPS, true);
 	if (!deptype || deptype->n == 0)
 		return;
-	if (strcmp(deptype->s, "gcc") != 0) {
+	if (strcmp(deptype->s, "msvc") == 0) {
+		deps = &msvcdeps;
+	} else if (strcmp(deptype->s, "gcc") == 0) {
+		depfile = edgevar(e, SYM_DEPFILE, false);
+		if (!depfile || depfile->n == 0) {
+			warn("deps but no depfile");
+			return;
+		}
+		deps = depsparse(depfile->s, true);
+		if (!buildopts.keepdepfile)
+			remove(depfile->s);
+		if (!deps)
+			return;
+	} else {
 		warn("unsuported deps type: %s", deptype->s);
 		return;
 	}
-	depfile = edgevar(e, "depfile", false);
-	if (!depfile || depfile->n == 0) {
-		warn("deps but no depfile");
-		return;
-	}
+	if (12 + deps->len * 4 + 4 >= MAX_RECORD_SIZE)
+		fatal("deps record too large");
 	out = e->out[0];
-	deps = depsparse(depfile->s, true);
-	if (!buildopts.keepdepfile)
-		remove(depfile->s);
-	if (!deps)
-		return;
 	update = false;
-	entry = NULL;
 	if (recordid(out)) {
 		update = true;
 	} else {
@@ -495,9 +922,22 @@ depsrecord(struct edge *e)
 		if (recordid(n))
 			update = true;
 	}
-	if (update) {
-		recorddeps(out, deps, out->mtime);
-		if (fflush(depsfile) < 0)
-			fatal("deps log flush:");
+	if (!update)
+		return;
+	recorddeps(out, deps, out->mtime);
+	if (fflush(depsfile) < 0 || ferror(depsfile))
+		fatal("deps log write failed");
+	entry = &entries[out->id];
+	free(entry->deps.node);
+	entry->deps.node = xreallocarray(NULL, deps->len, sizeof(deps->node[0]));
+	memcpy(entry->deps.node, deps->node, deps->len * sizeof(deps->node[0]));
+	entry->deps.len = deps->len;
+	entry->mtime = out->mtime;
+	if (compact.pid != -1) {
+		if (compact.pending.len == compact.pendingcap) {
+			compact.pendingcap = compact.pendingcap ? compact.pendingcap * 2 : 32;
+			compact.pending.node = xreallocarray(compact.pending.node, compact.pendingcap, sizeof(compact.pending.node[0]));
+		}
+		compact.pending.node[compact.pending.len++] = out;
 	}
 }
@@ -1,6 +1,14 @@
+struct buffer;
 struct edge;
 
 void depsinit(const char *);
 void depsclose(void);
+void depsreopen(const char *);
+/* keep the loaded entries, so the next depsinit with the same build directory
+ * only attaches them to the new graph */
+void depssave(const char *);
 void depsload(struct edge *);
+/* the dependencies of a node recorded in the deps log, which may be out of date */
+struct node **depsrecorded(struct node *, size_t *);
+void depsfilter(struct edge *, struct buffer *);
 void depsrecord(struct edge *);
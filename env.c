@@ -3,55 +3,223 @@
 #include <string.h>
 #include "env.h"
 #include "graph.h"
-#include "tree.h"
+#include "htab.h"
 #include "util.h"
 
+struct binding {
+	int key;
+	void *value;
+};
+
+/* a rule variable compiled into literal text with variable slots */
+struct template {
+	/* total length and start of the literal text */
+	size_t len;
+	char *text;
+	size_t nslot;
+	struct slot {
+		/* offset into the text where the value goes */
+		size_t off;
+		int var;
+		/* the value during expansion */
+		struct string *val;
+	} slot[];
+};
+
+struct symbol {
+	int id;
+	char name[];
+};
+
 struct environment {
 	struct environment *parent;
-	struct treenode *bindings;
-	struct treenode *rules;
+	struct table bindings;
+	struct table rules;
 	struct environment *allnext;
 };
 
 struct environment *rootenv;
-struct rule phonyrule = {.name = "phony"};
-struct pool consolepool = {.name = "console", .maxjobs = 1};
-static struct treenode *pools;
+struct rule phonyrule = {.name = SYM_PHONY};
+struct pool consolepool = {.name = SYM_CONSOLE, .maxjobs = 1};
+static struct table pools;
 static struct environment *allenvs;
+static struct hashtable *symtab;
+static struct symbol **syms;
+static size_t nsyms;
 
 static void addpool(struct pool *);
 static void delpool(void *);
 static void delrule(void *);
 
+/* find the index of the first binding with a key not less than the given one */
+static size_t
+tablesearch(struct table *t, int key)
+{
+	size_t low = 0, high = t->len, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (t->tab[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static void **
+tablefind(struct table *t, int key)
+{
+	size_t i;
+
+	i = tablesearch(t, key);
+	if (i < t->len && t->tab[i].key == key)
+		return &t->tab[i].value;
+	return NULL;
+}
+
+/* insert a value into a table, returning the value it replaced, if any */
+static void *
+tableinsert(struct table *t, int key, void *value)
+{
+	size_t i;
+	void *old;
+
+	i = tablesearch(t, key);
+	if (i < t->len && t->tab[i].key == key) {
+		old = t->tab[i].value;
+		t->tab[i].value = value;
+		return old;
+	}
+	if (t->len == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 4;
+		t->tab = xreallocarray(t->tab, t->cap, sizeof(t->tab[0]));
+	}
+	memmove(&t->tab[i + 1], &t->tab[i], (t->len - i) * sizeof(t->tab[0]));
+	t->tab[i].key = key;
+	t->tab[i].value = value;
+	++t->len;
+
+	return NULL;
+}
+
+void
+deltable(struct table *t, void del(void *))
+{
+	size_t i;
+
+	if (del) {
+		for (i = 0; i < t->len; ++i)
+			del(t->tab[i].value);
+	}
+	free(t->tab);
+	t->tab = NULL;
+	t->len = 0;
+	t->cap = 0;
+}
+
+static void
+syminit(void)
+{
+	/* must stay in the same order as the SYM_* constants */
+	static const char *const names[] = {
+		"in",
+		"in_newline",
+		"out",
+		"builddir",
+		"command",
+		"console",
+		"cpu_weight",
+		"depfile",
+		"deps",
+		"depth",
+		"description",
+		"generator",
+		"memory_max",
+		"msvc_deps_prefix",
+		"ninja_required_version",
+		"phony",
+		"pool",
+		"pool_weight",
+		"restat",
+		"rspfile",
+		"rspfile_content",
+		"worker",
+	};
+	size_t i;
+
+	symtab = mkhtab(256);
+	for (i = 0; i < countof(names); ++i)
+		mksym(names[i], strlen(names[i]));
+}
+
 void
 envinit(void)
 {
 	struct environment *env;
 
+	/* symbols are kept if we rebuilt the manifest */
+	if (!symtab)
+		syminit();
+
 	/* free old environments and pools in case we rebuilt the manifest */
 	while (allenvs) {
 		env = allenvs;
 		allenvs = env->allnext;
-		deltree(env->bindings, free, free);
-		deltree(env->rules, NULL, delrule);
+		deltable(&env->bindings, free);
+		deltable(&env->rules, delrule);
 		free(env);
 	}
-	deltree(pools, NULL, delpool);
+	deltable(&pools, delpool);
 
 	rootenv = mkenv(NULL);
 	envaddrule(rootenv, &phonyrule);
-	pools = NULL;
 	addpool(&consolepool);
 }
 
-static void
-addvar(struct treenode **tree, char *var, void *val)
+int
+mksym(const char *name, size_t len)
 {
-	char *old;
+	static size_t max;
+	struct hashtablekey k;
+	struct symbol *sym;
+
+	htabkey(&k, name, len);
+	sym = htabget(symtab, &k);
+	if (sym)
+		return sym->id;
+	if (nsyms == max) {
+		max = max ? max * 2 : 64;
+		syms = xreallocarray(syms, max, sizeof(syms[0]));
+	}
+	sym = xmalloc(sizeof(*sym) + len + 1);
+	sym->id = nsyms;
+	memcpy(sym->name, name, len);
+	sym->name[len] = '\0';
+	/* the table references the key, so it must point into the symbol */
+	htabkey(&k, sym->name, len);
+	*htabput(symtab, &k) = sym;
+	syms[nsyms++] = sym;
+
+	return sym->id;
+}
 
-	old = treeinsert(tree, var, val);
-	if (old)
-		free(old);
+int
+symget(const char *name)
+{
+	struct hashtablekey k;
+	struct symbol *sym;
+
+	htabkey(&k, name, strlen(name));
+	sym = htabget(symtab, &k);
+
+	return sym ? sym->id : -1;
+}
+
+const char *
+symname(int id)
+{
+	return syms[id]->name;
 }
 
 struct environment *
@@ -61,8 +229,8 @@ mkenv(struct environment *parent)
 
 	env = xmalloc(sizeof(*env));
 	env->parent = parent;
-	env->bindings = NULL;
-	env->rules = NULL;
+	env->bindings = (struct table){0};
+	env->rules = (struct table){0};
 	env->allnext = allenvs;
 	allenvs = env;
 
@@ -70,14 +238,14 @@ mkenv(struct environment *parent)
 }
 
 struct string *
-envvar(struct environment *env, char *var)
+envvar(struct environment *env, int var)
 {
-	struct treenode *n;
+	void **v;
 
 	do {
-		n = treefind(env->bindings, var);
-		if (n)
-			return n->value;
+		v = tablefind(&env->bindings, var);
+		if (v)
+			return *v;
 		env = env->parent;
 	} while (env);
 
@@ -85,9 +253,9 @@ envvar(struct environment *env, char *var)
 }
 
 void
-envaddvar(struct environment *env, char *var, struct string *val)
+envaddvar(struct environment *env, int var, struct string *val)
 {
-	addvar(&env->bindings, var, val);
+	free(tableinsert(&env->bindings, var, val));
 }
 
 static struct string *
@@ -119,7 +287,7 @@ enveval(struct environment *env, struct evalstring *str)
 
 	n = 0;
 	for (p = str; p; p = p->next) {
-		if (p->var)
+		if (p->var != -1)
 			p->str = envvar(env, p->var);
 		if (p->str)
 			n += p->str->n;
@@ -133,19 +301,19 @@ enveval(struct environment *env, struct evalstring *str)
 void
 envaddrule(struct environment *env, struct rule *r)
 {
-	if (treeinsert(&env->rules, r->name, r))
-		fatal("rule '%s' redefined", r->name);
+	if (tableinsert(&env->rules, r->name, r))
+		fatal("rule '%s' redefined", symname(r->name));
 }
 
 struct rule *
-envrule(struct environment *env, char *name)
+envrule(struct environment *env, int name)
 {
-	struct treenode *n;
+	void **v;
 
 	do {
-		n = treefind(env->rules, name);
-		if (n)
-			return n->value;
+		v = tablefind(&env->rules, name);
+		if (v)
+			return *v;
 		env = env->parent;
 	} while (env);
 
@@ -179,13 +347,13 @@ pathlist(struct node **nodes, size_t n, char sep, bool escape)
 }
 
 struct rule *
-mkrule(char *name)
+mkrule(int name)
 {
 	struct rule *r;
 
 	r = xmalloc(sizeof(*r));
 	r->name = name;
-	r->bindings = NULL;
+	r->bindings = (struct table){0};
 
 	return r;
 }
@@ -197,61 +365,125 @@ delrule(void *ptr)
 
 	if (r == &phonyrule)
 		return;
-	deltree(r->bindings, free, delevalstr);
-	free(r->name);
+	deltable(&r->bindings, free);
 	free(r);
 }
 
 void
-ruleaddvar(struct rule *r, char *var, struct evalstring *val)
+ruleaddvar(struct rule *r, int var, struct evalstring *val)
 {
-	addvar(&r->bindings, var, val);
+	struct template *t;
+	struct evalstring *p;
+	struct slot *slot;
+	size_t len, nslot;
+	char *s;
+
+	len = 0;
+	nslot = 0;
+	for (p = val; p; p = p->next) {
+		if (p->var != -1)
+			++nslot;
+		else
+			len += p->str->n;
+	}
+	/* the text is stored after the slots */
+	t = xmalloc(sizeof(*t) + nslot * sizeof(t->slot[0]) + len);
+	t->len = len;
+	t->text = (char *)&t->slot[nslot];
+	t->nslot = nslot;
+	s = t->text;
+	slot = t->slot;
+	for (p = val; p; p = p->next) {
+		if (p->var != -1) {
+			slot->off = s - t->text;
+			slot->var = p->var;
+			++slot;
+		} else {
+			memcpy(s, p->str->s, p->str->n);
+			s += p->str->n;
+		}
+	}
+	delevalstr(val);
+	free(tableinsert(&r->bindings, var, t));
 }
 
 struct string *
-edgevar(struct edge *e, char *var, bool escape)
+edgevar(struct edge *e, int var, bool escape)
 {
 	static void *const cycle = (void *)&cycle;
-	struct evalstring *str, *p;
-	struct treenode *n;
-	size_t len;
-
-	if (strcmp(var, "in") == 0)
-		return pathlist(e->in, e->inimpidx, ' ', escape);
-	if (strcmp(var, "in_newline") == 0)
-		return pathlist(e->in, e->inimpidx, '\n', escape);
-	if (strcmp(var, "out") == 0)
-		return pathlist(e->out, e->outimpidx, ' ', escape);
-	n = treefind(e->env->bindings, var);
-	if (n)
-		return n->value;
-	n = treefind(e->rule->bindings, var);
-	if (!n)
+	struct template *t;
+	struct slot *slot, *end;
+	struct string *val;
+	void **v;
+	size_t len, off;
+	char *s;
+	int key;
+
+	/* values allocated here are cached until the edge is freed */
+	key = var << 1 | escape;
+	v = tablefind(&e->vars, key);
+	if (v)
+		return *v;
+	switch (var) {
+	case SYM_IN:
+	case SYM_IN_NEWLINE:
+		val = pathlist(e->in, e->inimpidx, var == SYM_IN ? ' ' : '\n', escape);
+		if (e->inimpidx < 2)
+			return val;
+		goto done;
+	case SYM_OUT:
+		val = pathlist(e->out, e->outimpidx, ' ', escape);
+		if (e->outimpidx < 2)
+			return val;
+		goto done;
+	}
+	v = tablefind(&e->env->bindings, var);
+	if (v)
+		return *v;
+	/* rule tables are not modified during evaluation, so v stays valid */
+	v = tablefind(&e->rule->bindings, var);
+	if (!v)
 		return envvar(e->env->parent, var);
-	if (n->value == cycle)
-		fatal("cycle in rule variable involving '%s'", var);
-	str = n->value;
-	n->value = cycle;
-	len = 0;
-	for (p = str; p; p = p->next) {
-		if (p->var)
-			p->str = edgevar(e, p->var, escape);
-		if (p->str)
-			len += p->str->n;
+	if (*v == cycle)
+		fatal("cycle in rule variable involving '%s'", symname(var));
+	t = *v;
+	*v = cycle;
+	len = t->len;
+	end = t->slot + t->nslot;
+	for (slot = t->slot; slot != end; ++slot) {
+		slot->val = edgevar(e, slot->var, escape);
+		if (slot->val)
+			len += slot->val->n;
+	}
+	*v = t;
+	val = mkstr(len);
+	s = val->s;
+	off = 0;
+	for (slot = t->slot; slot != end; ++slot) {
+		memcpy(s, t->text + off, slot->off - off);
+		s += slot->off - off;
+		off = slot->off;
+		if (slot->val) {
+			memcpy(s, slot->val->s, slot->val->n);
+			s += slot->val->n;
+		}
 	}
-	n->value = str;
-	return merge(str, len);
+	memcpy(s, t->text + off, t->len - off);
+	s[t->len - off] = '\0';
+done:
+	tableinsert(&e->vars, key, val);
+	return val;
 }
 
 static void
 addpool(struct pool *p)
 {
-	if (treeinsert(&pools, p->name, p))
-		fatal("pool '%s' redefined", p->name);
+	if (tableinsert(&pools, p->name, p))
+		fatal("pool '%s' redefined", symname(p->name));
 }
 
 struct pool *
-mkpool(char *name)
+mkpool(int name)
 {
 	struct pool *p;
 
@@ -260,6 +492,8 @@ mkpool(char *name)
 	p->numjobs = 0;
 	p->maxjobs = 0;
 	p->work = NULL;
+	p->cpuweight = NULL;
+	p->memorymax = NULL;
 	addpool(p);
 
 	return p;
@@ -272,18 +506,19 @@ delpool(void *ptr)
 
 	if (p == &consolepool)
 		return;
-	free(p->name);
+	free(p->cpuweight);
+	free(p->memorymax);
 	free(p);
 }
 
 struct pool *
-poolget(char *name)
+poolget(const char *name)
 {
-	struct treenode *n;
+	void **v;
 
-	n = treefind(pools, name);
-	if (!n)
+	v = tablefind(&pools, symget(name));
+	if (!v)
 		fatal("unknown pool '%s'", name);
 
-	return n->value;
+	return *v;
 }
@@ -1,46 +1,91 @@
 struct evalstring;
 struct string;
 
+/* symbols interned by envinit, in this order */
+enum {
+	SYM_IN,
+	SYM_IN_NEWLINE,
+	SYM_OUT,
+	SYM_BUILDDIR,
+	SYM_COMMAND,
+	SYM_CONSOLE,
+	SYM_CPU_WEIGHT,
+	SYM_DEPFILE,
+	SYM_DEPS,
+	SYM_DEPTH,
+	SYM_DESCRIPTION,
+	SYM_GENERATOR,
+	SYM_MEMORY_MAX,
+	SYM_MSVC_DEPS_PREFIX,
+	SYM_NINJA_REQUIRED_VERSION,
+	SYM_PHONY,
+	SYM_POOL,
+	SYM_POOL_WEIGHT,
+	SYM_RESTAT,
+	SYM_RSPFILE,
+	SYM_RSPFILE_CONTENT,
+	SYM_WORKER,
+};
+
+/* a map from symbols to values, kept sorted by symbol */
+struct table {
+	struct binding *tab;
+	size_t len, cap;
+};
+
+/* free a table, and its values if a function is given */
+void deltable(struct table *, void(void *));
+
 struct rule {
-	char *name;
-	struct treenode *bindings;
+	int name;
+	struct table bindings;
 };
 
 struct pool {
-	char *name;
+	int name;
 	int numjobs, maxjobs;
 
 	/* a queue of ready edges blocked by the pool's capacity */
 	struct edge *work;
+
+	/* limits for the pool's cgroup, or NULL */
+	struct string *cpuweight, *memorymax;
 };
 
 void envinit(void);
 
+/* intern a name, returning its symbol */
+int mksym(const char *, size_t);
+/* lookup the symbol for a name, returning -1 if it was never interned */
+int symget(const char *);
+/* return the name of a symbol */
+const char *symname(int);
+
 /* create a new environment with an optional parent */
 struct environment *mkenv(struct environment *);
 /* search environment and its parents for a variable, returning the value or NULL if not found */
-struct string *envvar(struct environment *, char *);
+struct string *envvar(struct environment *, int);
 /* add to environment a variable and its value, replacing the old value if there is one */
-void envaddvar(struct environment *, char *, struct string *);
+void envaddvar(struct environment *, int, struct string *);
 /* evaluate an unevaluated string within an environment, returning the result */
 struct string *enveval(struct environment *, struct evalstring *);
 /* search an environment and its parents for a rule, returning the rule or NULL if not found */
-struct rule *envrule(struct environment *, char *);
+struct rule *envrule(struct environment *, int);
 /* add a rule to an environment, or fail if the rule already exists */
 void envaddrule(struct environment *, struct rule *);
 
 /* create a new rule with the given name */
-struct rule *mkrule(char *);
+struct rule *mkrule(int);
 /* add to rule a variable and its value */
-void ruleaddvar(struct rule *, char *, struct evalstring *);
+void ruleaddvar(struct rule *, int, struct evalstring *);
 
 /* create a new pool with the given name */
-struct pool *mkpool(char *);
+struct pool *mkpool(int);
 /* lookup a pool by name, or fail if it does not exist */
-struct pool *poolget(char *);
+struct pool *poolget(const char *);
 
 /* evaluate and return an edge's variable, optionally shell-escaped */
-struct string *edgevar(struct edge *, char *, _Bool);
+struct string *edgevar(struct edge *, int, _Bool);
 
 extern struct environment *rootenv;
 extern struct rule phonyrule;
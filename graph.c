@@ -8,9 +8,56 @@
 #include "os.h"
 #include "util.h"
 
+/* nodes and edges are carved out of large blocks in creation order */
+struct arena {
+	char **blocks;
+	size_t nblocks;
+	char *next;
+	size_t avail;
+};
+
+enum {
+	ARENABLOCK = 64 * 1024,
+};
+
 static struct hashtable *allnodes;
+static struct arena nodearena, edgearena;
 struct edge *alledges;
 
+static void *
+arenaalloc(struct arena *a, size_t size)
+{
+	void *p;
+
+	if (a->avail < size) {
+		/* allocate in powers of two */
+		if (!(a->nblocks & (a->nblocks - 1)))
+			a->blocks = xreallocarray(a->blocks, a->nblocks ? a->nblocks * 2 : 1, sizeof(a->blocks[0]));
+		a->next = xmalloc(ARENABLOCK);
+		a->blocks[a->nblocks++] = a->next;
+		a->avail = ARENABLOCK;
+	}
+	p = a->next;
+	a->next += size;
+	a->avail -= size;
+
+	return p;
+}
+
+static void
+arenafree(struct arena *a)
+{
+	size_t i;
+
+	for (i = 0; i < a->nblocks; ++i)
+		free(a->blocks[i]);
+	free(a->blocks);
+	a->blocks = NULL;
+	a->nblocks = 0;
+	a->next = NULL;
+	a->avail = 0;
+}
+
 static void
 delnode(void *p)
 {
@@ -20,13 +67,17 @@ delnode(void *p)
 		free(n->shellpath);
 	free(n->use);
 	free(n->path);
-	free(n);
 }
 
 void
 graphinit(void)
 {
 	struct edge *e;
+	size_t cap;
+
+	/* size the table for as many nodes as the old graph had, if any */
+	for (cap = 1024; cap - cap / 8 < htablen(allnodes); cap *= 2)
+		;
 
 	/* delete old nodes and edges in case we rebuilt the manifest */
 	delhtab(allnodes, delnode);
@@ -35,25 +86,38 @@ graphinit(void)
 		alledges = e->allnext;
 		free(e->out);
 		free(e->in);
-		free(e);
+		deltable(&e->vars, free);
 	}
-	allnodes = mkhtab(1024);
+	arenafree(&edgearena);
+	arenafree(&nodearena);
+	allnodes = mkhtab(cap);
 }
 
 struct node *
 mknode(struct string *path)
+{
+	struct hashtablekey k;
+
+	htabkey(&k, path->s, path->n);
+	return mknodehash(path, k.hash);
+}
+
+struct node *
+mknodehash(struct string *path, uint64_t hash)
 {
 	void **v;
 	struct node *n;
 	struct hashtablekey k;
 
-	htabkey(&k, path->s, path->n);
+	k.hash = hash;
+	k.str = path->s;
+	k.len = path->n;
 	v = htabput(allnodes, &k);
 	if (*v) {
 		free(path);
 		return *v;
 	}
-	n = xmalloc(sizeof(*n));
+	n = arenaalloc(&nodearena, sizeof(*n));
 	n->path = path;
 	n->shellpath = NULL;
 	n->gen = NULL;
@@ -62,6 +126,10 @@ mknode(struct string *path)
 	n->mtime = MTIME_UNKNOWN;
 	n->logmtime = MTIME_MISSING;
 	n->hash = 0;
+	n->pathhash = hash;
+	n->maxrss = 0;
+	n->logstart = 0;
+	n->logend = 0;
 	n->id = -1;
 	*v = n;
 
@@ -79,6 +147,33 @@ nodeget(const char *path, size_t len)
 	return htabget(allnodes, &k);
 }
 
+struct node *
+nodegethash(const char *path, size_t len, uint64_t hash)
+{
+	struct hashtablekey k;
+
+	k.hash = hash;
+	k.str = path;
+	k.len = len;
+	return htabget(allnodes, &k);
+}
+
+void
+eachnode(void fn(struct node *))
+{
+	struct arena *a = &nodearena;
+	struct node *n, *end;
+	size_t i, used;
+
+	for (i = 0; i < a->nblocks; ++i) {
+		/* every block but the last was filled until a node no longer fit */
+		used = i + 1 < a->nblocks ? ARENABLOCK / sizeof(*n) : (ARENABLOCK - a->avail) / sizeof(*n);
+		n = (struct node *)a->blocks[i];
+		for (end = n + used; n != end; ++n)
+			fn(n);
+	}
+}
+
 void
 nodestat(struct node *n)
 {
@@ -136,13 +231,15 @@ mkedge(struct environment *parent)
 {
 	struct edge *e;
 
-	e = xmalloc(sizeof(*e));
+	e = arenaalloc(&edgearena, sizeof(*e));
 	e->env = mkenv(parent);
 	e->pool = NULL;
+	e->weight = 1;
 	e->out = NULL;
 	e->nout = 0;
 	e->in = NULL;
 	e->nin = 0;
+	e->vars = (struct table){0};
 	e->flags = 0;
 	e->allnext = alledges;
 	alledges = e;
@@ -159,10 +256,10 @@ edgehash(struct edge *e)
 	if (e->flags & FLAG_HASH)
 		return;
 	e->flags |= FLAG_HASH;
-	cmd = edgevar(e, "command", true);
+	cmd = edgevar(e, SYM_COMMAND, true);
 	if (!cmd)
-		fatal("rule '%s' has no command", e->rule->name);
-	rsp = edgevar(e, "rspfile_content", true);
+		fatal("rule '%s' has no command", symname(e->rule->name));
+	rsp = edgevar(e, SYM_RSPFILE_CONTENT, true);
 	if (rsp && rsp->n > 0) {
 		s = mkstr(cmd->n + sizeof(sep) - 1 + rsp->n);
 		memcpy(s->s, cmd->s, cmd->n);
@@ -206,6 +303,7 @@ edgeadddeps(struct edge *e, struct node **deps, size_t ndeps)
 		nodeuse(n, e);
 	}
 	e->in = xreallocarray(e->in, e->nin + ndeps, sizeof(e->in[0]));
+	/* implicit inputs are not part of $in, so cached variables stay valid */
 	order = e->in + e->inorderidx;
 	norder = e->nin - e->inorderidx;
 	memmove(order + ndeps, order, norder * sizeof(e->in[0]));
@@ -6,12 +6,12 @@ enum {
 	MTIME_UNKNOWN = -1,
 	/* the file does not exist */
 	MTIME_MISSING = -2,
+	/* a stat of the file is about to be done by another thread */
+	MTIME_QUEUED = -3,
 };
 
+/* fields used while checking and building the graph come first */
 struct node {
-	/* shellpath is the escaped shell path, and is populated as needed by nodepath */
-	struct string *path, *shellpath;
-
 	/* modification time of file (in nanoseconds) and build log entry (in seconds) */
 	int64_t mtime, logmtime;
 
@@ -19,14 +19,27 @@ struct node {
 	struct edge *gen, **use;
 	size_t nuse;
 
-	/* command hash used to build this output, read from build log */
-	uint64_t hash;
+	/* does the node need to be rebuilt */
+	_Bool dirty;
 
 	/* ID for .ninja_deps. -1 if not present in log. */
 	int32_t id;
 
-	/* does the node need to be rebuilt */
-	_Bool dirty;
+	/* command hash used to build this output, read from build log */
+	uint64_t hash;
+
+	/* hash of the path, as used by the node table */
+	uint64_t pathhash;
+
+	/* peak memory use in KiB of the job that built this output, read from rss log */
+	uint64_t maxrss;
+
+	/* start and end time in milliseconds of the job that built this output,
+	 * since the start of its build, read from build log */
+	uint32_t logstart, logend;
+
+	/* shellpath is the escaped shell path, and is populated as needed by nodepath */
+	struct string *path, *shellpath;
 };
 
 /* build rule, i.e., edge between inputs and outputs */
@@ -35,6 +48,9 @@ struct edge {
 	struct pool *pool;
 	struct environment *env;
 
+	/* number of job slots taken while running, both in the pool and overall */
+	size_t weight;
+
 	/* input and output nodes */
 	struct node **out, **in;
 	size_t nout, nin;
@@ -66,14 +82,23 @@ struct edge {
 	struct edge *worknext;
 	/* used for alledges linked list */
 	struct edge *allnext;
+
+	/* evaluated variables, cached by edgevar */
+	struct table vars;
 };
 
 void graphinit(void);
 
 /* create a new node or return existing node */
 struct node *mknode(struct string *);
+/* create a new node or return existing node, given the hash of its path */
+struct node *mknodehash(struct string *, uint64_t);
 /* lookup a node by name; returns NULL if it does not exist */
 struct node *nodeget(const char *, size_t);
+/* lookup a node by name and previously computed path hash */
+struct node *nodegethash(const char *, size_t, uint64_t);
+/* call a function for every node */
+void eachnode(void fn(struct node *));
 /* update the mtime field of a node */
 void nodestat(struct node *);
 /* get a node's path, possibly escaped for the shell */
@@ -4,11 +4,25 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "util.h"
 #include "htab.h"
 
+/*
+ * Slots are probed in groups of GROUP, using a control byte per slot that
+ * is either EMPTY or holds the low 7 bits of the hash of the key in that
+ * slot. Entries are never removed, so there are no tombstones.
+ */
+enum {
+	GROUP = 16,
+	EMPTY = 0x80,
+};
+
 struct hashtable {
 	size_t len, cap;
+	unsigned char *ctrl;
 	struct hashtablekey *keys;
 	void **vals;
 };
@@ -21,20 +35,27 @@ htabkey(struct hashtablekey *k, const char *s, size_t n)
 	k->hash = rapidhashv1(s, n);
 }
 
+static void
+alloc(struct hashtable *h, size_t cap)
+{
+	h->cap = cap;
+	h->ctrl = xmalloc(cap);
+	memset(h->ctrl, EMPTY, cap);
+	h->keys = xreallocarray(NULL, cap, sizeof(h->keys[0]));
+	h->vals = xreallocarray(NULL, cap, sizeof(h->vals[0]));
+}
+
 struct hashtable *
 mkhtab(size_t cap)
 {
 	struct hashtable *h;
-	size_t i;
 
 	assert(!(cap & (cap - 1)));
+	if (cap < GROUP)
+		cap = GROUP;
 	h = xmalloc(sizeof(*h));
 	h->len = 0;
-	h->cap = cap;
-	h->keys = xreallocarray(NULL, cap, sizeof(h->keys[0]));
-	h->vals = xreallocarray(NULL, cap, sizeof(h->vals[0]));
-	for (i = 0; i < cap; ++i)
-		h->keys[i].str = NULL;
+	alloc(h, cap);
 
 	return h;
 }
@@ -48,15 +69,51 @@ delhtab(struct hashtable *h, void del(void *))
 		return;
 	if (del) {
 		for (i = 0; i < h->cap; ++i) {
-			if (h->keys[i].str)
+			if (h->ctrl[i] != EMPTY)
 				del(h->vals[i]);
 		}
 	}
+	free(h->ctrl);
 	free(h->keys);
 	free(h->vals);
 	free(h);
 }
 
+/* return a bit mask of the slots in a group with the given control byte */
+static unsigned
+match(const unsigned char *ctrl, unsigned char c)
+{
+#ifdef __SSE2__
+	__m128i g;
+
+	g = _mm_loadu_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+	unsigned m;
+	int i;
+
+	m = 0;
+	for (i = 0; i < GROUP; ++i)
+		m |= (unsigned)(ctrl[i] == c) << i;
+	return m;
+#endif
+}
+
+/* return the index of the lowest set bit */
+static int
+lowbit(unsigned m)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(m);
+#else
+	int i;
+
+	for (i = 0; !(m & 1); ++i)
+		m >>= 1;
+	return i;
+#endif
+}
+
 static bool
 keyequal(struct hashtablekey *k1, struct hashtablekey *k2)
 {
@@ -65,45 +122,71 @@ keyequal(struct hashtablekey *k1, struct hashtablekey *k2)
 	return memcmp(k1->str, k2->str, k1->len) == 0;
 }
 
+/* return the slot containing the key, or the empty slot where it belongs */
 static size_t
 keyindex(struct hashtable *h, struct hashtablekey *k)
 {
-	size_t i;
+	unsigned char tag;
+	unsigned m;
+	size_t i, j;
 
-	i = k->hash & (h->cap - 1);
-	while (h->keys[i].str && !keyequal(&h->keys[i], k))
-		i = (i + 1) & (h->cap - 1);
-	return i;
+	tag = k->hash & 0x7f;
+	i = (k->hash >> 7) & (h->cap - GROUP);
+	for (;;) {
+		for (m = match(h->ctrl + i, tag); m; m &= m - 1) {
+			j = i + lowbit(m);
+			if (keyequal(&h->keys[j], k))
+				return j;
+		}
+		m = match(h->ctrl + i, EMPTY);
+		if (m)
+			return i + lowbit(m);
+		i = (i + GROUP) & (h->cap - 1);
+	}
 }
 
-void **
-htabput(struct hashtable *h, struct hashtablekey *k)
+static void
+grow(struct hashtable *h)
 {
+	unsigned char *oldctrl;
 	struct hashtablekey *oldkeys;
 	void **oldvals;
 	size_t i, j, oldcap;
+	unsigned m;
 
-	if (h->cap / 2 < h->len) {
-		oldkeys = h->keys;
-		oldvals = h->vals;
-		oldcap = h->cap;
-		h->cap *= 2;
-		h->keys = xreallocarray(NULL, h->cap, sizeof(h->keys[0]));
-		h->vals = xreallocarray(NULL, h->cap, sizeof(h->vals[0]));
-		for (i = 0; i < h->cap; ++i)
-			h->keys[i].str = NULL;
-		for (i = 0; i < oldcap; ++i) {
-			if (oldkeys[i].str) {
-				j = keyindex(h, &oldkeys[i]);
-				h->keys[j] = oldkeys[i];
-				h->vals[j] = oldvals[i];
-			}
-		}
-		free(oldkeys);
-		free(oldvals);
+	oldctrl = h->ctrl;
+	oldkeys = h->keys;
+	oldvals = h->vals;
+	oldcap = h->cap;
+	alloc(h, oldcap * 2);
+	for (i = 0; i < oldcap; ++i) {
+		if (oldctrl[i] == EMPTY)
+			continue;
+		/* the keys are distinct, so we only need an empty slot */
+		j = (oldkeys[i].hash >> 7) & (h->cap - GROUP);
+		while (!(m = match(h->ctrl + j, EMPTY)))
+			j = (j + GROUP) & (h->cap - 1);
+		j += lowbit(m);
+		h->ctrl[j] = oldctrl[i];
+		h->keys[j] = oldkeys[i];
+		h->vals[j] = oldvals[i];
 	}
+	free(oldctrl);
+	free(oldkeys);
+	free(oldvals);
+}
+
+void **
+htabput(struct hashtable *h, struct hashtablekey *k)
+{
+	size_t i;
+
+	/* keep the load factor at most 7/8 */
+	if (h->len >= h->cap - h->cap / 8)
+		grow(h);
 	i = keyindex(h, k);
-	if (!h->keys[i].str) {
+	if (h->ctrl[i] == EMPTY) {
+		h->ctrl[i] = k->hash & 0x7f;
 		h->keys[i] = *k;
 		h->vals[i] = NULL;
 		++h->len;
@@ -118,7 +201,13 @@ htabget(struct hashtable *h, struct hashtablekey *k)
 	size_t i;
 
 	i = keyindex(h, k);
-	return h->keys[i].str ? h->vals[i] : NULL;
+	return h->ctrl[i] != EMPTY ? h->vals[i] : NULL;
+}
+
+size_t
+htablen(struct hashtable *h)
+{
+	return h ? h->len : 0;
 }
 
 static inline uint_least32_t
@@ -12,5 +12,6 @@ struct hashtable *mkhtab(size_t);
 void delhtab(struct hashtable *, void(void *));
 void **htabput(struct hashtable *, struct hashtablekey *);
 void *htabget(struct hashtable *, struct hashtablekey *);
+size_t htablen(struct hashtable *);
 
 uint64_t rapidhashv1(const void *, size_t);
@@ -1,10 +1,14 @@
 #include <errno.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "env.h"
 #include "graph.h"
+#include "htab.h"
 #include "log.h"
+#include "os.h"
 #include "util.h"
 
 static FILE *logfile;
@@ -13,38 +17,165 @@ static const char *logtmpname = ".ninja_log.tmp";
 static const char *logfmt = "# ninja log v%d\n";
 static const int logver = 7;
 
+/* background compaction of the build log */
+static struct {
+	pid_t pid;
+	/* offset in the old log of records appended since compaction started */
+	long offset;
+	char *path, *tmppath;
+} compact = {.pid = -1};
+
+/* records for paths that are not outputs in the graph, kept in case the
+ * manifest is regenerated, along with the entries of the outputs while it
+ * is reloaded */
+static struct {
+	bool valid;
+	char *builddir;
+	struct logentry {
+		struct string *path;
+		uint64_t pathhash;
+		int64_t mtime;
+		uint64_t hash;
+		uint32_t start, end;
+	} *entry;
+	size_t len, cap;
+} saved;
+
+/* return the next field and store its length, if requested */
 static char *
-nextfield(char **end)
+nextfield(char **end, size_t *len)
 {
 	char *s = *end;
+	size_t n;
 
 	if (!*s) {
 		warn("corrupt build log: missing field");
 		return NULL;
 	}
-	*end += strcspn(*end, "\t\n");
+	n = strcspn(*end, "\t\n");
+	if (len)
+		*len = n;
+	*end += n;
 	if (**end)
 		*(*end)++ = '\0';
 
 	return s;
 }
 
+/* write a record for every node with a command hash */
+static void
+logwrite(void)
+{
+	struct edge *e;
+	struct node *n;
+	size_t i;
+
+	for (e = alledges; e; e = e->allnext) {
+		for (i = 0; i < e->nout; ++i) {
+			n = e->out[i];
+			if (!n->hash)
+				continue;
+			logrecord(n);
+		}
+	}
+}
+
+/* runs in a child process to write a compacted log */
+static int
+logcompact(void)
+{
+	logfile = fopen(compact.tmppath, "w");
+	if (!logfile) {
+		warn("open %s:", compact.tmppath);
+		return 1;
+	}
+	fprintf(logfile, logfmt, logver);
+	logwrite();
+	if (fflush(logfile) != 0 || ferror(logfile)) {
+		warn("build log write failed");
+		return 1;
+	}
+	if (fclose(logfile) != 0) {
+		warn("build log write:");
+		return 1;
+	}
+	return 0;
+}
+
+static struct logentry *
+keep(const char *path, size_t len, uint64_t pathhash)
+{
+	struct logentry *entry;
+
+	if (saved.len == saved.cap) {
+		saved.cap = saved.cap ? saved.cap * 2 : 1024;
+		saved.entry = xreallocarray(saved.entry, saved.cap, sizeof(saved.entry[0]));
+	}
+	entry = &saved.entry[saved.len++];
+	entry->path = mkstr(len);
+	memcpy(entry->path->s, path, len);
+	entry->path->s[len] = '\0';
+	entry->pathhash = pathhash;
+
+	return entry;
+}
+
+/* attach the kept entries to the outputs of the new graph, keeping the
+ * rest, if requested, or discard all of them */
+static void
+logrestore(bool apply)
+{
+	struct logentry *entry;
+	struct node *n;
+	size_t i, len;
+
+	len = 0;
+	for (i = 0; i < saved.len; ++i) {
+		entry = &saved.entry[i];
+		if (apply) {
+			n = nodegethash(entry->path->s, entry->path->n, entry->pathhash);
+			if (!n || !n->gen) {
+				saved.entry[len++] = *entry;
+				continue;
+			}
+			n->logmtime = entry->mtime;
+			n->hash = entry->hash;
+			n->logstart = entry->start;
+			n->logend = entry->end;
+		}
+		free(entry->path);
+	}
+	saved.len = len;
+	saved.valid = false;
+	free(saved.builddir);
+	saved.builddir = NULL;
+}
+
 void
 loginit(const char *builddir)
 {
 	int ver;
 	char *logpath = (char *)logname, *logtmppath = (char *)logtmpname, *p, *s;
-	size_t nline, nentry, i;
-	struct edge *e;
+	size_t nline, nentry, len;
 	struct node *n;
+	struct logentry *entry;
+	struct hashtablekey k;
 	int64_t mtime;
+	uint64_t hash;
+	unsigned long start, end;
 	struct buffer buf = {0};
 
 	nline = 0;
 	nentry = 0;
 
+	if (saved.valid && (builddir ? saved.builddir && strcmp(builddir, saved.builddir) == 0 : !saved.builddir)) {
+		/* the log is still open, so only the entries need to be restored */
+		logrestore(true);
+		return;
+	}
+	logrestore(false);
 	if (logfile)
-		fclose(logfile);
+		logclose();
 	if (builddir)
 		xasprintf(&logpath, "%s/%s", builddir, logname);
 	logfile = fopen(logpath, "r+");
@@ -74,11 +205,23 @@ loginit(const char *builddir)
 		++nline;
 		p = buf.data;
 		buf.len = 0;
-		if (!nextfield(&p))  /* start time */
+		s = nextfield(&p, NULL);  /* start time */
+		if (!s)
 			continue;
-		if (!nextfield(&p))  /* end time */
+		start = strtoul(s, &s, 10);
+		if (*s) {
+			warn("corrupt build log: invalid start time");
 			continue;
-		s = nextfield(&p);  /* mtime (used for restat) */
+		}
+		s = nextfield(&p, NULL);  /* end time */
+		if (!s)
+			continue;
+		end = strtoul(s, &s, 10);
+		if (*s) {
+			warn("corrupt build log: invalid end time");
+			continue;
+		}
+		s = nextfield(&p, NULL);  /* mtime (used for restat) */
 		if (!s)
 			continue;
 		mtime = strtoll(s, &s, 10);
@@ -86,23 +229,33 @@ loginit(const char *builddir)
 			warn("corrupt build log: invalid mtime");
 			continue;
 		}
-		s = nextfield(&p);  /* output path */
+		s = nextfield(&p, &len);  /* output path */
 		if (!s)
 			continue;
-		n = nodeget(s, 0);
-		if (!n || !n->gen)
-			continue;
-		if (n->logmtime == MTIME_MISSING)
-			++nentry;
-		n->logmtime = mtime;
-		s = nextfield(&p);  /* command hash */
+		htabkey(&k, s, len);
+		s = nextfield(&p, NULL);  /* command hash */
 		if (!s)
 			continue;
-		n->hash = strtoull(s, &s, 16);
+		hash = strtoull(s, &s, 16);
 		if (*s) {
-			warn("corrupt build log: invalid hash for '%s'", n->path->s);
+			warn("corrupt build log: invalid hash for '%s'", k.str);
+			continue;
+		}
+		n = nodegethash(k.str, k.len, k.hash);
+		if (!n || !n->gen) {
+			entry = keep(k.str, k.len, k.hash);
+			entry->mtime = mtime;
+			entry->hash = hash;
+			entry->start = start;
+			entry->end = end;
 			continue;
 		}
+		if (n->logmtime == MTIME_MISSING)
+			++nentry;
+		n->logmtime = mtime;
+		n->hash = hash;
+		n->logstart = start;
+		n->logend = end;
 	}
 	free(buf.data);
 	if (ferror(logfile)) {
@@ -115,26 +268,34 @@ loginit(const char *builddir)
 		return;
 	}
 
+	/* the log is valid, so keep appending to it while a compacted copy
+	 * is written in the background. the compacted log only has records for
+	 * outputs in the graph, so the others are no longer kept */
+	logrestore(false);
+	if (builddir)
+		xasprintf(&logtmppath, "%s/%s", builddir, logtmpname);
+	compact.path = logpath;
+	compact.tmppath = logtmppath;
+	if (fseek(logfile, 0, SEEK_END) == 0 && (compact.offset = ftell(logfile)) != -1) {
+		compact.pid = osfork(logcompact);
+		if (compact.pid != -1)
+			return;
+	}
+	warn("failed to start build log compaction");
+
 rewrite:
+	logrestore(false);
 	if (logfile)
 		fclose(logfile);
-	if (builddir)
+	if (builddir && logtmppath == logtmpname)
 		xasprintf(&logtmppath, "%s/%s", builddir, logtmpname);
 	logfile = fopen(logtmppath, "w");
 	if (!logfile)
 		fatal("open %s:", logtmppath);
 	setvbuf(logfile, NULL, _IOLBF, 0);
 	fprintf(logfile, logfmt, logver);
-	if (nentry > 0) {
-		for (e = alledges; e; e = e->allnext) {
-			for (i = 0; i < e->nout; ++i) {
-				n = e->out[i];
-				if (!n->hash)
-					continue;
-				logrecord(n);
-			}
-		}
-	}
+	if (nentry > 0)
+		logwrite();
 	fflush(logfile);
 	if (ferror(logfile))
 		fatal("build log write failed");
@@ -146,17 +307,109 @@ rewrite:
 	}
 }
 
+/* finish background compaction, replaying records appended to the old
+ * log into the new one before swapping it into place */
+static void
+compactdone(void)
+{
+	FILE *f;
+	char buf[BUFSIZ];
+	size_t n;
+	bool ok;
+
+	ok = oswait(compact.pid);
+	compact.pid = -1;
+	if (!ok) {
+		warn("build log compaction failed");
+		goto err;
+	}
+	f = fopen(compact.tmppath, "a");
+	if (!f) {
+		warn("open %s:", compact.tmppath);
+		goto err;
+	}
+	if (fseek(logfile, compact.offset, SEEK_SET) != 0) {
+		warn("build log seek:");
+		goto err1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), logfile)) > 0) {
+		if (fwrite(buf, 1, n, f) != n)
+			break;
+	}
+	if (ferror(logfile) || fflush(f) != 0 || ferror(f)) {
+		warn("build log compaction failed:");
+		goto err1;
+	}
+	fclose(f);
+	if (rename(compact.tmppath, compact.path) < 0)
+		warn("build log rename:");
+	goto done;
+
+err1:
+	fclose(f);
+err:
+	remove(compact.tmppath);
+done:
+	if (compact.path != logname) {
+		free(compact.path);
+		free(compact.tmppath);
+	}
+}
+
 void
 logclose(void)
 {
 	fflush(logfile);
 	if (ferror(logfile))
 		fatal("build log write failed");
+	if (compact.pid != -1)
+		compactdone();
 	fclose(logfile);
+	logfile = NULL;
+}
+
+/* open the build log for appending after it was loaded and closed */
+void
+logreopen(const char *builddir)
+{
+	char *logpath = (char *)logname;
+
+	if (builddir)
+		xasprintf(&logpath, "%s/%s", builddir, logname);
+	logfile = fopen(logpath, "a");
+	if (!logfile)
+		fatal("open %s:", logpath);
+	setvbuf(logfile, NULL, _IOLBF, 0);
+	if (builddir)
+		free(logpath);
+}
+
+void
+logsave(const char *builddir)
+{
+	struct logentry *entry;
+	struct edge *e;
+	struct node *n;
+	size_t i;
+
+	saved.valid = true;
+	saved.builddir = builddir ? xmemdup(builddir, strlen(builddir) + 1) : NULL;
+	for (e = alledges; e; e = e->allnext) {
+		for (i = 0; i < e->nout; ++i) {
+			n = e->out[i];
+			if (n->logmtime == MTIME_MISSING)
+				continue;
+			entry = keep(n->path->s, n->path->n, n->pathhash);
+			entry->mtime = n->logmtime;
+			entry->hash = n->hash;
+			entry->start = n->logstart;
+			entry->end = n->logend;
+		}
+	}
 }
 
 void
 logrecord(struct node *n)
 {
-	fprintf(logfile, "0\t0\t%" PRId64 "\t%s\t%" PRIx64 "\n", n->logmtime, n->path->s, n->hash);
+	fprintf(logfile, "%" PRIu32 "\t%" PRIu32 "\t%" PRId64 "\t%s\t%" PRIx64 "\n", n->logstart, n->logend, n->logmtime, n->path->s, n->hash);
 }
@@ -2,4 +2,8 @@ struct node;
 
 void loginit(const char *);
 void logclose(void);
+void logreopen(const char *);
+/* keep the loaded entries, so the next loginit with the same build directory
+ * only attaches them to the new graph */
+void logsave(const char *);
 void logrecord(struct node *);
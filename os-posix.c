@@ -3,16 +3,21 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #ifndef NO_POSIX_SPAWN
 #include <spawn.h>
 #endif
+#include "env.h"
 #include "graph.h"
 #include "os.h"
 #include "util.h"
 
+extern const char *argv0;
+
 void
 osgetcwd(char *buf, size_t len)
 {
@@ -99,10 +104,30 @@ osnproc(void)
 #endif
 }
 
-pid_t
-osspawn(char *const argv[], int outfd)
+/* report an error in a child before it runs its command, without stdio,
+ * which another thread may have held locked across the fork */
+static void
+childfail(const char *msg)
+{
+	const char *parts[] = {argv0, ": ", msg, ": ", strerror(errno), "\n"};
+	char buf[256];
+	size_t i, n, len;
+
+	len = 0;
+	for (i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+		n = strlen(parts[i]);
+		if (n > sizeof(buf) - len)
+			n = sizeof(buf) - len;
+		memcpy(buf + len, parts[i], n);
+		len += n;
+	}
+	write(2, buf, len);
+	_exit(1);
+}
+
+static pid_t
+forkspawn(char *const argv[], int outfd, int cgroupfd)
 {
-#ifdef NO_POSIX_SPAWN
 	pid_t pid;
 	int i, fd[3];
 
@@ -120,6 +145,15 @@ osspawn(char *const argv[], int outfd)
 					_exit(1);
 			}
 		}
+		/* join the cgroup before running the command, so that all of
+		 * its processes are accounted for. this comes after the
+		 * output is redirected, so a failure shows up with the job */
+		if (cgroupfd != -1) {
+			fd[0] = openat(cgroupfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+			if (fd[0] == -1 || write(fd[0], "0", 1) != 1)
+				childfail("join cgroup");
+			close(fd[0]);
+		}
 		execvp(argv[0], argv);
 		_exit(1);
 		/* unreachable */
@@ -130,11 +164,21 @@ osspawn(char *const argv[], int outfd)
 		warn("fork:");
 		return -1;
 	}
+}
+
+pid_t
+osspawn(char *const argv[], int outfd, int cgroupfd)
+{
+#ifdef NO_POSIX_SPAWN
+	return forkspawn(argv, outfd, cgroupfd);
 #else
 	extern char **environ;
 	pid_t pid;
 	posix_spawn_file_actions_t actions;
 
+	/* posix_spawn has no way to start the process in a cgroup */
+	if (cgroupfd != -1)
+		return forkspawn(argv, outfd, cgroupfd);
 	if ((errno = posix_spawn_file_actions_init(&actions))) {
 		warn("posix_spawn_file_actions_init:");
 		goto err0;
@@ -166,3 +210,33 @@ err0:
 	return -1;
 #endif
 }
+
+pid_t
+osfork(int fn(void))
+{
+	pid_t pid;
+
+	pid = fork();
+	switch (pid) {
+	case 0:
+		_exit(fn());
+	case -1:
+		warn("fork:");
+		break;
+	}
+	return pid;
+}
+
+bool
+oswait(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			warn("waitpid %d:", (int)pid);
+			return false;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
@@ -11,5 +11,10 @@ int osmkdirs(struct string *, _Bool);
 int64_t osmtime(const char *);
 /* queries the number of online processors */
 long osnproc(void);
-/* spawn a child process */
-pid_t osspawn(char *const argv[], int fd);
+/* spawn a child process, in the cgroup with the given directory descriptor
+ * unless it is -1 */
+pid_t osspawn(char *const argv[], int fd, int cgroupfd);
+/* call a function in a child process, which exits with its return value */
+pid_t osfork(int fn(void));
+/* wait for a child process, returning whether it exited successfully */
+_Bool oswait(pid_t);
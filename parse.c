@@ -4,20 +4,58 @@
 #include <stdlib.h>
 #include "env.h"
 #include "graph.h"
+#include "htab.h"
+#include "os.h"
 #include "parse.h"
 #include "scan.h"
 #include "util.h"
 
 struct parseoptions parseopts;
+struct manifest *manifests;
+size_t nmanifests;
 static struct node **deftarg;
 static size_t ndeftarg;
 
 void
 parseinit(void)
 {
+	size_t i;
+
 	free(deftarg);
 	deftarg = NULL;
 	ndeftarg = 0;
+	for (i = 0; i < nmanifests; ++i)
+		free(manifests[i].path);
+	free(manifests);
+	manifests = NULL;
+	nmanifests = 0;
+}
+
+bool
+manifestchanged(void)
+{
+	struct scanner s;
+	struct manifest *m;
+	int64_t mtime;
+	uint64_t hash;
+	size_t i;
+
+	for (i = 0; i < nmanifests; ++i) {
+		m = &manifests[i];
+		mtime = osmtime(m->path);
+		if (mtime == m->mtime)
+			continue;
+		if (mtime == MTIME_MISSING)
+			return true;
+		/* generators often rewrite files without changing them */
+		scaninit(&s, m->path);
+		hash = rapidhashv1(s.data, s.end - s.data);
+		scanclose(&s);
+		if (hash != m->hash)
+			return true;
+		m->mtime = mtime;
+	}
+	return false;
 }
 
 static void
@@ -32,7 +70,7 @@ static void
 parserule(struct scanner *s, struct environment *env)
 {
 	struct rule *r;
-	char *var;
+	int var;
 	struct evalstring *val;
 	bool hascommand = false, hasrspfile = false, hasrspcontent = false;
 
@@ -41,20 +79,20 @@ parserule(struct scanner *s, struct environment *env)
 	while (scanindent(s)) {
 		var = scanname(s);
 		parselet(s, &val);
+		if (val) {
+			if (var == SYM_COMMAND)
+				hascommand = true;
+			else if (var == SYM_RSPFILE)
+				hasrspfile = true;
+			else if (var == SYM_RSPFILE_CONTENT)
+				hasrspcontent = true;
+		}
 		ruleaddvar(r, var, val);
-		if (!val)
-			continue;
-		if (strcmp(var, "command") == 0)
-			hascommand = true;
-		else if (strcmp(var, "rspfile") == 0)
-			hasrspfile = true;
-		else if (strcmp(var, "rspfile_content") == 0)
-			hasrspcontent = true;
 	}
 	if (!hascommand)
-		fatal("rule '%s' has no command", r->name);
+		fatal("rule '%s' has no command", symname(r->name));
 	if (hasrspfile != hasrspcontent)
-		fatal("rule '%s' has rspfile and no rspfile_content or vice versa", r->name);
+		fatal("rule '%s' has rspfile and no rspfile_content or vice versa", symname(r->name));
 	envaddrule(env, r);
 }
 
@@ -63,11 +101,13 @@ parseedge(struct scanner *s, struct environment *env)
 {
 	struct edge *e;
 	struct evalstring *str, **path;
-	char *name;
+	int name;
 	struct string *val;
 	struct node *n;
 	size_t i;
 	int p;
+	long weight;
+	char *end;
 
 	e = mkedge(env);
 
@@ -82,8 +122,7 @@ parseedge(struct scanner *s, struct environment *env)
 	name = scanname(s);
 	e->rule = envrule(env, name);
 	if (!e->rule)
-		fatal("undefined rule '%s'", name);
-	free(name);
+		fatal("undefined rule '%s'", symname(name));
 	scanpaths(s);
 	e->inimpidx = npaths - e->nout;
 	p = scanpipe(s, 1 | 2);
@@ -131,9 +170,18 @@ parseedge(struct scanner *s, struct environment *env)
 	}
 	npaths = 0;
 
-	val = edgevar(e, "pool", true);
+	val = edgevar(e, SYM_POOL, true);
 	if (val)
 		e->pool = poolget(val->s);
+	val = edgevar(e, SYM_POOL_WEIGHT, true);
+	if (val) {
+		weight = strtol(val->s, &end, 10);
+		if (*end || weight < 1)
+			fatal("invalid pool_weight '%s'", val->s);
+		e->weight = weight;
+		if (e->pool && e->weight > (size_t)e->pool->maxjobs)
+			e->weight = e->pool->maxjobs;
+	}
 }
 
 static void
@@ -182,25 +230,32 @@ parsepool(struct scanner *s, struct environment *env)
 	struct pool *p;
 	struct evalstring *val;
 	struct string *str;
-	char *var, *end;
+	char *end;
+	int var;
 
 	p = mkpool(scanname(s));
 	scannewline(s);
 	while (scanindent(s)) {
 		var = scanname(s);
 		parselet(s, &val);
-		if (strcmp(var, "depth") == 0) {
+		if (var == SYM_DEPTH) {
 			str = enveval(env, val);
 			p->maxjobs = strtol(str->s, &end, 10);
 			if (*end)
 				fatal("invalid pool depth '%s'", str->s);
 			free(str);
+		} else if (var == SYM_CPU_WEIGHT) {
+			free(p->cpuweight);
+			p->cpuweight = enveval(env, val);
+		} else if (var == SYM_MEMORY_MAX) {
+			free(p->memorymax);
+			p->memorymax = enveval(env, val);
 		} else {
-			fatal("unexpected pool variable '%s'", var);
+			fatal("unexpected pool variable '%s'", symname(var));
 		}
 	}
 	if (!p->maxjobs)
-		fatal("pool '%s' has no depth", p->name);
+		fatal("pool '%s' has no depth", symname(p->name));
 }
 
 static void
@@ -218,11 +273,20 @@ void
 parse(const char *name, struct environment *env)
 {
 	struct scanner s;
-	char *var;
+	int var;
 	struct string *val;
 	struct evalstring *str;
+	struct manifest *m;
+
+	/* allocate in powers of two */
+	if (!(nmanifests & (nmanifests - 1)))
+		manifests = xreallocarray(manifests, nmanifests ? nmanifests * 2 : 1, sizeof(manifests[0]));
+	m = &manifests[nmanifests++];
+	m->path = xmemdup(name, strlen(name) + 1);
+	m->mtime = osmtime(name);
 
 	scaninit(&s, name);
+	m->hash = rapidhashv1(s.data, s.end - s.data);
 	for (;;) {
 		switch (scankeyword(&s, &var)) {
 		case RULE:
@@ -246,7 +310,7 @@ parse(const char *name, struct environment *env)
 		case VARIABLE:
 			parselet(&s, &str);
 			val = enveval(env, str);
-			if (strcmp(var, "ninja_required_version") == 0)
+			if (var == SYM_NINJA_REQUIRED_VERSION)
 				checkversion(val->s);
 			envaddvar(env, var, val);
 			break;
@@ -1,3 +1,5 @@
+#include <stdint.h>  /* for int64_t, uint64_t */
+
 struct environment;
 struct node;
 
@@ -5,10 +7,22 @@ struct parseoptions {
 	_Bool dupbuildwarn;
 };
 
+/* a file read by parse, its mtime before it was read, and a hash of its contents */
+struct manifest {
+	char *path;
+	int64_t mtime;
+	uint64_t hash;
+};
+
 void parseinit(void);
 void parse(const char *, struct environment *);
+/* check whether the contents of any file read by parse have changed */
+_Bool manifestchanged(void);
 
 extern struct parseoptions parseopts;
+/* the files read since parseinit */
+extern struct manifest *manifests;
+extern size_t nmanifests;
 
 /* supported ninja version */
 enum {
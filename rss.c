@@ -0,0 +1,167 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "env.h"
+#include "graph.h"
+#include "rss.h"
+#include "util.h"
+
+/*
+.samu_rss file format
+
+The first line is "# samu rss v1". Each line after it records the peak
+resident set size in KiB of the job that built an output, followed by a tab
+and the path of the first output of the job. Later lines replace earlier ones
+for the same output.
+*/
+
+static FILE *rssfile;
+static const char rssname[] = ".samu_rss";
+static const char rsstmpname[] = ".samu_rss.tmp";
+static const char rssheader[] = "# samu rss v1\n";
+
+/* largest peak memory use seen for each rule, indexed by rule name */
+static uint64_t *rulerss;
+static size_t rulersslen;
+
+static void
+updaterule(struct rule *r, uint64_t rss)
+{
+	size_t len;
+
+	if ((size_t)r->name >= rulersslen) {
+		len = rulersslen ? rulersslen : 64;
+		while (len <= (size_t)r->name)
+			len *= 2;
+		rulerss = xreallocarray(rulerss, len, sizeof(rulerss[0]));
+		memset(rulerss + rulersslen, 0, (len - rulersslen) * sizeof(rulerss[0]));
+		rulersslen = len;
+	}
+	if (rss > rulerss[r->name])
+		rulerss[r->name] = rss;
+}
+
+static void
+rsswrite(struct node *n)
+{
+	fprintf(rssfile, "%" PRIu64 "\t%s\n", n->maxrss, n->path->s);
+}
+
+void
+rssinit(const char *builddir)
+{
+	char *rsspath = (char *)rssname, *rsstmppath = (char *)rsstmpname, *line, *s;
+	size_t nline, nentry, cap;
+	ssize_t len;
+	struct node *n;
+	struct edge *e;
+	uint64_t rss;
+
+	if (rssfile)
+		rssclose();
+	memset(rulerss, 0, rulersslen * sizeof(rulerss[0]));
+	if (builddir)
+		xasprintf(&rsspath, "%s/%s", builddir, rssname);
+	nline = 0;
+	nentry = 0;
+	line = NULL;
+	cap = 0;
+	rssfile = fopen(rsspath, "r+");
+	if (!rssfile) {
+		if (errno != ENOENT)
+			fatal("open %s:", rsspath);
+		goto rewrite;
+	}
+	len = getline(&line, &cap, rssfile);
+	if (len < 0 || strcmp(line, rssheader) != 0)
+		goto rewrite;
+	while ((len = getline(&line, &cap, rssfile)) > 0) {
+		++nline;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		rss = strtoull(line, &s, 10);
+		if (*s != '\t') {
+			warn("corrupt rss log: invalid size");
+			continue;
+		}
+		++s;
+		n = nodeget(s, line + len - s);
+		if (!n || !n->gen)
+			continue;
+		if (!n->maxrss)
+			++nentry;
+		n->maxrss = rss;
+		updaterule(n->gen->rule, rss);
+	}
+	if (ferror(rssfile)) {
+		warn("rss log read:");
+		goto rewrite;
+	}
+	free(line);
+	line = NULL;
+	if (nline <= 100 || nline <= 3 * nentry) {
+		if (builddir)
+			free(rsspath);
+		return;
+	}
+
+rewrite:
+	free(line);
+	if (rssfile)
+		fclose(rssfile);
+	if (builddir)
+		xasprintf(&rsstmppath, "%s/%s", builddir, rsstmpname);
+	rssfile = fopen(rsstmppath, "w");
+	if (!rssfile)
+		fatal("open %s:", rsstmppath);
+	fputs(rssheader, rssfile);
+	for (e = alledges; e; e = e->allnext) {
+		if (e->nout > 0 && e->out[0]->maxrss)
+			rsswrite(e->out[0]);
+	}
+	fflush(rssfile);
+	if (ferror(rssfile))
+		fatal("rss log write failed");
+	if (rename(rsstmppath, rsspath) < 0)
+		fatal("rss log rename:");
+	if (builddir) {
+		free(rsspath);
+		free(rsstmppath);
+	}
+}
+
+void
+rssclose(void)
+{
+	fflush(rssfile);
+	if (ferror(rssfile))
+		fatal("rss log write failed");
+	fclose(rssfile);
+	rssfile = NULL;
+}
+
+void
+rssrecord(struct edge *e, uint64_t rss)
+{
+	struct node *n;
+
+	if (e->nout == 0)
+		return;
+	n = e->out[0];
+	n->maxrss = rss;
+	updaterule(e->rule, rss);
+	rsswrite(n);
+}
+
+uint64_t
+rssexpect(struct edge *e)
+{
+	if (e->nout > 0 && e->out[0]->maxrss)
+		return e->out[0]->maxrss;
+	if ((size_t)e->rule->name < rulersslen)
+		return rulerss[e->rule->name];
+	return 0;
+}
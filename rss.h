@@ -0,0 +1,12 @@
+#include <stdint.h>  /* for uint64_t */
+
+struct edge;
+
+/* load the peak memory use recorded for the jobs that built each output */
+void rssinit(const char *);
+void rssclose(void);
+/* record the peak memory use in KiB of the job that built an edge */
+void rssrecord(struct edge *, uint64_t);
+/* the peak memory use in KiB expected of an edge's job, from the last time it
+ * ran, or the most that a job of its rule needed, or 0 if not known */
+uint64_t rssexpect(struct edge *);
@@ -5,21 +5,26 @@
 #include <string.h>
 #include "arg.h"
 #include "build.h"
+#include "cgroup.h"
 #include "deps.h"
 #include "env.h"
 #include "graph.h"
 #include "log.h"
 #include "os.h"
 #include "parse.h"
+#include "rss.h"
+#include "server.h"
+#include "statcache.h"
 #include "tool.h"
 #include "util.h"
+#include "worker.h"
 
 const char *argv0;
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-C dir] [-f buildfile] [-j maxjobs] [-k maxfail] [-l maxload] [-n]\n", argv0);
+	fprintf(stderr, "usage: %s [-C dir] [-f buildfile] [-c cgroup] [-j maxjobs] [-k maxfail] [-l maxload] [-m maxmem] [-p maxpressure] [-ns]\n", argv0);
 	exit(2);
 }
 
@@ -28,7 +33,7 @@ getbuilddir(void)
 {
 	struct string *builddir;
 
-	builddir = envvar(rootenv, "builddir");
+	builddir = envvar(rootenv, SYM_BUILDDIR);
 	if (!builddir)
 		return NULL;
 	if (osmkdirs(builddir, false) < 0)
@@ -45,6 +50,10 @@ debugflag(const char *flag)
 		buildopts.keepdepfile = true;
 	else if (strcmp(flag, "keeprsp") == 0)
 		buildopts.keeprsp = true;
+	else if (strcmp(flag, "statcache") == 0)
+		buildopts.statcache = true;
+	else if (strcmp(flag, "stats") == 0)
+		buildopts.stats = true;
 	else
 		fatal("unknown debug flag '%s'", flag);
 }
@@ -66,6 +75,73 @@ loadflag(const char *flag)
 #endif
 }
 
+#ifdef HAVE_WAIT4
+/* queries the memory available for new processes in KiB */
+static uint64_t
+memavailable(void)
+{
+	FILE *f;
+	char line[256];
+	unsigned long long kb;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		fatal("open /proc/meminfo:");
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+			fclose(f);
+			return kb;
+		}
+	}
+	fatal("available memory not found in /proc/meminfo");
+	return 0;
+}
+#endif
+
+static void
+memflag(const char *flag)
+{
+#ifdef HAVE_WAIT4
+	double value;
+	char *end;
+	errno = 0;
+
+	value = strtod(flag, &end);
+	if (value < 0 || errno != 0)
+		fatal("invalid -m parameter");
+	if (*end == '%') {
+		if (end[1] || value > 100)
+			fatal("invalid -m parameter");
+		buildopts.maxmem = memavailable() * (value / 100);
+	} else {
+		if (*end)
+			fatal("invalid -m parameter");
+		buildopts.maxmem = value * 1024;
+	}
+#else
+	warn("job scheduling based on memory use is not supported");
+#endif
+}
+
+static void
+pressureflag(const char *flag)
+{
+	double value;
+	char *end;
+	FILE *f;
+	errno = 0;
+
+	value = strtod(flag, &end);
+	if (*end || value < 0 || value > 100 || errno != 0)
+		fatal("invalid -p parameter");
+	f = fopen("/proc/pressure/cpu", "r");
+	if (f)
+		fclose(f);
+	else if (value)
+		warn("job scheduling based on pressure stall information is not supported");
+	buildopts.maxpressure = value;
+}
+
 static void
 warnflag(const char *flag)
 {
@@ -119,6 +195,9 @@ parseenvargs(char *env)
 	case 'l':
 		loadflag(EARGF(usage()));
 		break;
+	case 'p':
+		pressureflag(EARGF(usage()));
+		break;
 	default:
 		fatal("invalid option in SAMUFLAGS");
 	} ARGEND
@@ -144,7 +223,8 @@ main(int argc, char *argv[])
 	const struct tool *tool = NULL;
 	struct node *n;
 	long num;
-	int tries;
+	int tries, status;
+	bool serving = false;
 
 	argv0 = progname(argv[0], "samu");
 	parseenvargs(getenv("SAMUFLAGS"));
@@ -160,6 +240,9 @@ main(int argc, char *argv[])
 			usage();
 		}
 		break;
+	case 'c':
+		buildopts.cgroup = EARGF(usage());
+		break;
 	case 'C':
 		arg = EARGF(usage());
 		warn("entering directory '%s'", arg);
@@ -183,9 +266,18 @@ main(int argc, char *argv[])
 	case 'l':
 		loadflag(EARGF(usage()));
 		break;
+	case 'm':
+		memflag(EARGF(usage()));
+		break;
 	case 'n':
 		buildopts.dryrun = true;
 		break;
+	case 'p':
+		pressureflag(EARGF(usage()));
+		break;
+	case 's':
+		serving = true;
+		break;
 	case 't':
 		tool = toolget(EARGF(usage()));
 		goto argdone;
@@ -221,6 +313,17 @@ argdone:
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
 	tries = 0;
+	if (serving) {
+		/* returns in a new process for each build */
+		argv = serve(manifest, &argc);
+		builddir = getbuilddir();
+		goto loaded;
+	} else if (!tool) {
+		/* let a server in this directory do the build, if there is one */
+		status = serverbuild(manifest, argv);
+		if (status != -1)
+			return status;
+	}
 retry:
 	/* (re-)initialize global graph, environment, and parse structures */
 	graphinit();
@@ -237,6 +340,14 @@ retry:
 	builddir = getbuilddir();
 	loginit(builddir);
 	depsinit(builddir);
+	if (buildopts.statcache)
+		statinit(builddir);
+
+loaded:
+	if (buildopts.maxmem)
+		rssinit(builddir);
+	if (buildopts.cgroup && !buildopts.dryrun)
+		cgroupinit(buildopts.cgroup);
 
 	/* rebuild the manifest if it's dirty */
 	n = nodeget(manifest, 0);
@@ -247,10 +358,15 @@ retry:
 			if (n->gen->flags & FLAG_DIRTY_OUT || n->gen->nprune > 0) {
 				if (++tries > 100)
 					fatal("manifest '%s' dirty after 100 tries", manifest);
-				if (!buildopts.dryrun)
+				/* only reparse if the generator changed something */
+				if (!buildopts.dryrun && manifestchanged()) {
+					/* keep the logs loaded while the manifest is reparsed */
+					logsave(builddir);
+					depssave(builddir);
 					goto retry;
+				}
 			}
-			/* manifest was pruned; reset state, then continue with build */
+			/* manifest was pruned or left as it was; reset state, then continue with build */
 			buildreset();
 		}
 	}
@@ -269,6 +385,13 @@ retry:
 	build();
 	logclose();
 	depsclose();
+	if (buildopts.maxmem)
+		rssclose();
+	if (buildopts.cgroup && !buildopts.dryrun)
+		cgroupclose();
+	workerclose();
+	if (buildopts.statcache && !buildopts.dryrun)
+		statclose();
 
 	return 0;
 }
@@ -4,6 +4,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "env.h"
 #include "scan.h"
 #include "util.h"
 
@@ -11,22 +15,46 @@ struct evalstring **paths;
 size_t npaths;
 static struct buffer buf;
 
+enum {
+	/* zeroed bytes after the end of the data, so blocks can be loaded past it */
+	PADDING = 16,
+};
+
 void
 scaninit(struct scanner *s, const char *path)
 {
+	FILE *f;
+	size_t len, cap;
+
 	s->path = path;
 	s->line = 1;
 	s->col = 1;
-	s->f = fopen(path, "r");
-	if (!s->f)
+	f = fopen(path, "r");
+	if (!f)
 		fatal("open %s:", path);
-	s->chr = getc(s->f);
+	s->data = NULL;
+	len = 0;
+	cap = 0;
+	do {
+		if (cap - len < BUFSIZ + PADDING) {
+			cap = cap ? cap * 2 : BUFSIZ * 4;
+			s->data = xreallocarray(s->data, cap, 1);
+		}
+		len += fread(s->data + len, 1, cap - len - PADDING, f);
+	} while (!feof(f) && !ferror(f));
+	if (ferror(f))
+		fatal("read %s:", path);
+	fclose(f);
+	memset(s->data + len, 0, PADDING);
+	s->pos = s->data;
+	s->end = s->data + len;
+	s->chr = len ? (unsigned char)*s->pos : EOF;
 }
 
 void
 scanclose(struct scanner *s)
 {
-	fclose(s->f);
+	free(s->data);
 }
 
 void
@@ -52,11 +80,26 @@ next(struct scanner *s)
 	} else {
 		++s->col;
 	}
-	s->chr = getc(s->f);
+	if (++s->pos < s->end)
+		s->chr = (unsigned char)*s->pos;
+	else
+		s->chr = EOF;
 
 	return s->chr;
 }
 
+/* skip over n characters, none of which are newlines */
+static void
+skip(struct scanner *s, size_t n)
+{
+	s->col += n;
+	s->pos += n;
+	if (s->pos < s->end)
+		s->chr = (unsigned char)*s->pos;
+	else
+		s->chr = EOF;
+}
+
 static int
 issimplevar(int c)
 {
@@ -92,7 +135,8 @@ singlespace(struct scanner *s)
 		next(s);
 		if (newline(s))
 			return true;
-		ungetc(s->chr, s->f);
+		--s->pos;
+		--s->col;
 		s->chr = '$';
 		return false;
 	case ' ':
@@ -137,7 +181,7 @@ name(struct scanner *s)
 }
 
 int
-scankeyword(struct scanner *s, char **var)
+scankeyword(struct scanner *s, int *var)
 {
 	/* must stay in sorted order */
 	static const struct {
@@ -181,17 +225,17 @@ scankeyword(struct scanner *s, char **var)
 				else
 					low = mid + 1;
 			}
-			*var = xmemdup(buf.data, buf.len);
+			*var = mksym(buf.data, buf.len - 1);
 			return VARIABLE;
 		}
 	}
 }
 
-char *
+int
 scanname(struct scanner *s)
 {
 	name(s);
-	return xmemdup(buf.data, buf.len);
+	return mksym(buf.data, buf.len - 1);
 }
 
 static void
@@ -203,10 +247,9 @@ addstringpart(struct evalstring ***end, bool var)
 	p->next = NULL;
 	**end = p;
 	if (var) {
-		bufadd(&buf, '\0');
-		p->var = xmemdup(buf.data, buf.len);
+		p->var = mksym(buf.data, buf.len);
 	} else {
-		p->var = NULL;
+		p->var = -1;
 		p->str = mkstr(buf.len);
 		memcpy(p->str->s, buf.data, buf.len);
 		p->str->s[buf.len] = '\0';
@@ -253,10 +296,60 @@ escape(struct scanner *s, struct evalstring ***end)
 	}
 }
 
+/* return the length of the run of characters at the current position
+ * that have no special meaning in a string */
+static size_t
+literal(struct scanner *s, bool path)
+{
+	const char *p;
+#ifdef __SSE2__
+	__m128i c, m;
+	unsigned mask;
+
+	for (p = s->pos; p < s->end; p += 16) {
+		c = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('$')),
+		    _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r'))));
+		if (path) {
+			m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(':')),
+			    _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('|')), _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')))));
+		}
+		mask = _mm_movemask_epi8(m);
+		if (mask) {
+			while (!(mask & 1)) {
+				mask >>= 1;
+				++p;
+			}
+			break;
+		}
+	}
+	/* the block may extend into the padding past the end */
+	if (p > s->end)
+		p = s->end;
+#else
+	for (p = s->pos; p < s->end; ++p) {
+		switch (*p) {
+		case ':':
+		case '|':
+		case ' ':
+			if (!path)
+				break;
+			/* fallthrough */
+		case '$':
+		case '\r':
+		case '\n':
+			return p - s->pos;
+		}
+	}
+#endif
+	return p - s->pos;
+}
+
 struct evalstring *
 scanstring(struct scanner *s, bool path)
 {
 	struct evalstring *str = NULL, **end = &str;
+	size_t n;
 
 	buf.len = 0;
 	for (;;) {
@@ -272,8 +365,9 @@ scanstring(struct scanner *s, bool path)
 				goto out;
 			/* fallthrough */
 		default:
-			bufadd(&buf, s->chr);
-			next(s);
+			n = literal(s, path);
+			bufaddn(&buf, s->pos, n);
+			skip(s, n);
 			break;
 		case '\r':
 		case '\n':
@@ -9,7 +9,8 @@ enum token {
 };
 
 struct scanner {
-	FILE *f;
+	/* the file contents, and the position of the current character */
+	char *data, *pos, *end;
 	const char *path;
 	int chr, line, col;
 };
@@ -21,8 +22,8 @@ void scaninit(struct scanner *, const char *);
 void scanclose(struct scanner *);
 
 void scanerror(struct scanner *, const char *, ...);
-int scankeyword(struct scanner *, char **);
-char *scanname(struct scanner *);
+int scankeyword(struct scanner *, int *);
+int scanname(struct scanner *);
 struct evalstring *scanstring(struct scanner *, _Bool);
 void scanpaths(struct scanner *);
 void scanchar(struct scanner *, int);
@@ -0,0 +1,640 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+#include "build.h"
+#include "deps.h"
+#include "env.h"
+#include "graph.h"
+#include "htab.h"
+#include "log.h"
+#include "os.h"
+#include "parse.h"
+#include "server.h"
+#include "util.h"
+
+static const char sockname[] = ".samu.sock";
+
+enum {
+	/* changed whenever struct request changes */
+	REQUESTVERSION = 3,
+	/* maximum length of the strings following a request */
+	MAXREQUEST = 1 << 20,
+};
+
+/* sent by a client with its standard input, output, and error */
+struct request {
+	uint32_t version, size;
+	/* length of the manifest, status format, cgroup, and target strings
+	 * that follow */
+	size_t len;
+	struct buildoptions opts;
+	struct parseoptions parseopts;
+	/* process group of the client, which the build joins if it can */
+	pid_t pgid;
+};
+
+/* room for a control message carrying three file descriptors */
+union control {
+	struct cmsghdr hdr;
+	unsigned char buf[sizeof(struct cmsghdr) + 3 * sizeof(int) + 64];
+};
+
+static const char *manifest;
+static char *builddir, *logpath, *depspath;
+static int64_t logmtime, depsmtime;
+static int listenfd = -1;
+
+#ifdef HAVE_INOTIFY
+#define WATCHMASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY \
+	| IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+
+struct dir {
+	int wd;
+	char path[];
+};
+
+static int inotifyfd = -1;
+static struct hashtable *dirs;
+/* directories indexed by watch descriptor */
+static struct dir **wds;
+static size_t nwds;
+/* nodes whose directory could not be watched, so must be checked every time */
+static struct node **unwatched;
+static size_t nunwatched, unwatchedcap;
+#endif
+
+static void
+sockaddr(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, sockname, sizeof(sockname));
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+readall(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+serverbuild(const char *name, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct request req;
+	struct buffer buf = {0};
+	struct msghdr msg = {0};
+	const char *cgroup;
+	struct iovec iov;
+	union control ctl;
+	struct cmsghdr *c;
+	struct sigaction sa, oldsa;
+	int fd, ret, fds[] = {0, 1, 2};
+	unsigned char status;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	sockaddr(&addr);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	bufaddn(&buf, name, strlen(name) + 1);
+	bufaddn(&buf, buildopts.statusfmt, strlen(buildopts.statusfmt) + 1);
+	cgroup = buildopts.cgroup ? buildopts.cgroup : "";
+	bufaddn(&buf, cgroup, strlen(cgroup) + 1);
+	for (; *argv; ++argv)
+		bufaddn(&buf, *argv, strlen(*argv) + 1);
+	req.version = REQUESTVERSION;
+	req.size = sizeof(req);
+	req.len = buf.len;
+	req.opts = buildopts;
+	req.opts.statusfmt = NULL;
+	req.opts.cgroup = NULL;
+	req.parseopts = parseopts;
+	req.pgid = getpgrp();
+
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	c = &ctl.hdr;
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = (unsigned char *)CMSG_DATA(c) - ctl.buf + sizeof(fds);
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+	msg.msg_controllen = c->cmsg_len;
+
+	/* if the server goes away, fall back to building ourselves */
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, &oldsa);
+	ret = -1;
+	if (sendmsg(fd, &msg, 0) == sizeof(req) && writeall(fd, buf.data, buf.len) == 0 && readall(fd, &status, 1) == 0)
+		ret = status;
+	sigaction(SIGPIPE, &oldsa, NULL);
+	close(fd);
+	free(buf.data);
+
+	return ret;
+}
+
+static void
+invalidate(struct node *n)
+{
+	n->mtime = MTIME_UNKNOWN;
+}
+
+static void
+resetid(struct node *n)
+{
+	n->id = -1;
+}
+
+#ifdef HAVE_INOTIFY
+/* watch the directory containing a node, returning whether it is watched */
+static bool
+watch(struct node *n)
+{
+	struct hashtablekey k;
+	struct dir *d;
+	const char *path, *slash;
+	size_t len;
+	int wd;
+
+	path = n->path->s;
+	slash = strrchr(path, '/');
+	if (!slash)
+		path = ".", len = 1;
+	else if (slash == path)
+		len = 1;
+	else
+		len = slash - path;
+	htabkey(&k, path, len);
+	d = htabget(dirs, &k);
+	if (!d) {
+		d = xmalloc(sizeof(*d) + len + 1);
+		d->wd = -1;
+		memcpy(d->path, path, len);
+		d->path[len] = '\0';
+		htabkey(&k, d->path, len);
+		*htabput(dirs, &k) = d;
+	}
+	if (d->wd != -1)
+		return true;
+	wd = inotify_add_watch(inotifyfd, d->path, WATCHMASK);
+	if (wd < 0) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			warn("inotify_add_watch %s:", d->path);
+		return false;
+	}
+	if ((size_t)wd >= nwds) {
+		wds = xreallocarray(wds, wd + 1, sizeof(wds[0]));
+		memset(wds + nwds, 0, (wd + 1 - nwds) * sizeof(wds[0]));
+		nwds = wd + 1;
+	}
+	/* another path leads to the same directory, so events can't be
+	 * attributed to this one */
+	if (wds[wd] && wds[wd] != d)
+		return false;
+	wds[wd] = d;
+	d->wd = wd;
+
+	return true;
+}
+
+/* process pending change notifications */
+static void
+readevents(void)
+{
+	static struct buffer path;
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	struct inotify_event *ev;
+	struct dir *d;
+	struct node *n;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		len = read(inotifyfd, u.buf, sizeof(u.buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fatal("read inotify:");
+		}
+		for (p = u.buf; p < u.buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				eachnode(invalidate);
+				continue;
+			}
+			if (ev->wd < 0 || (size_t)ev->wd >= nwds || !(d = wds[ev->wd]))
+				continue;
+			if (ev->mask & IN_MOVE_SELF) {
+				/* the path no longer names this directory */
+				inotify_rm_watch(inotifyfd, ev->wd);
+			}
+			if (ev->mask & IN_IGNORED) {
+				wds[ev->wd] = NULL;
+				d->wd = -1;
+				eachnode(invalidate);
+				continue;
+			}
+			if (!ev->len)
+				continue;
+			path.len = 0;
+			if (strcmp(d->path, ".") != 0) {
+				bufaddn(&path, d->path, strlen(d->path));
+				if (strcmp(d->path, "/") != 0)
+					bufadd(&path, '/');
+			}
+			bufaddn(&path, ev->name, strlen(ev->name));
+			n = nodeget(path.data, path.len);
+			if (n)
+				n->mtime = MTIME_UNKNOWN;
+		}
+	}
+}
+#endif
+
+/* make sure a node's mtime is current */
+static void
+refresh(struct node *n)
+{
+#ifdef HAVE_INOTIFY
+	bool watched;
+
+	if (n->mtime != MTIME_UNKNOWN)
+		return;
+	/* watch first, so that no change is missed after the stat */
+	watched = watch(n);
+	nodestat(n);
+	if (watched)
+		return;
+	if (nunwatched == unwatchedcap) {
+		unwatchedcap = unwatchedcap ? unwatchedcap * 2 : 64;
+		unwatched = xreallocarray(unwatched, unwatchedcap, sizeof(unwatched[0]));
+	}
+	unwatched[nunwatched++] = n;
+#else
+	nodestat(n);
+#endif
+}
+
+static void
+loadlogs(void)
+{
+	/* the deps log assigns new IDs when it is reloaded */
+	eachnode(resetid);
+	loginit(builddir);
+	depsinit(builddir);
+	logclose();
+	depsclose();
+	logmtime = osmtime(logpath);
+	depsmtime = osmtime(depspath);
+}
+
+static void
+load(void)
+{
+	struct string *dir;
+
+#ifdef HAVE_INOTIFY
+	nunwatched = 0;
+#endif
+	graphinit();
+	envinit();
+	parseinit();
+	parse(manifest, rootenv);
+
+	free(logpath);
+	free(depspath);
+	dir = envvar(rootenv, SYM_BUILDDIR);
+	if (dir) {
+		if (osmkdirs(dir, false) < 0)
+			exit(1);
+		builddir = dir->s;
+		xasprintf(&logpath, "%s/.ninja_log", builddir);
+		xasprintf(&depspath, "%s/.ninja_deps", builddir);
+	} else {
+		builddir = NULL;
+		logpath = xmemdup(".ninja_log", sizeof(".ninja_log"));
+		depspath = xmemdup(".ninja_deps", sizeof(".ninja_deps"));
+	}
+	loadlogs();
+}
+
+/* receive a request and its file descriptors, returning the strings following it */
+static char *
+recvrequest(int fd, struct request *req, int fds[static 3])
+{
+	struct msghdr msg = {0};
+	struct iovec iov;
+	union control ctl;
+	struct cmsghdr *c;
+	char *buf;
+	size_t nfd;
+
+	fds[0] = fds[1] = fds[2] = -1;
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if (recvmsg(fd, &msg, 0) != sizeof(*req))
+		return NULL;
+	c = CMSG_FIRSTHDR(&msg);
+	if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+		return NULL;
+	nfd = (c->cmsg_len - ((unsigned char *)CMSG_DATA(c) - (unsigned char *)c)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(c), (nfd < 3 ? nfd : 3) * sizeof(int));
+	if (nfd != 3 || req->version != REQUESTVERSION || req->size != sizeof(*req) || req->len > MAXREQUEST)
+		return NULL;
+	buf = xmalloc(req->len + 1);
+	if (readall(fd, buf, req->len) < 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[req->len] = '\0';
+
+	return buf;
+}
+
+/* run a build for a client in a child process, returning its targets in
+ * the child, or NULL in the server */
+static char **
+request(int fd)
+{
+	struct request req;
+	struct pollfd pfd[2];
+	struct sigaction sa;
+	char *buf, *end, *s, *statusfmt, *cgroup, **targets;
+	size_t ntargets;
+	int fds[3], pipefd[2], status, i;
+	unsigned char ret;
+	bool killed;
+	pid_t pid;
+
+	targets = NULL;
+	buf = recvrequest(fd, &req, fds);
+	if (!buf)
+		goto done;
+	/* a request for another manifest, or with other options for parsing it,
+	 * is refused, and built by the client */
+	end = buf + req.len;
+	if (strcmp(buf, manifest) != 0 || req.parseopts.dupbuildwarn != parseopts.dupbuildwarn)
+		goto done;
+	s = buf + strlen(buf) + 1;
+	if (s >= end)
+		goto done;
+	statusfmt = s;
+	s += strlen(s) + 1;
+	if (s >= end)
+		goto done;
+	cgroup = s;
+	s += strlen(s) + 1;
+	ntargets = 0;
+	for (; s < end; s += strlen(s) + 1) {
+		if (!(ntargets & (ntargets - 1)))
+			targets = xreallocarray(targets, ntargets ? ntargets * 2 : 1, sizeof(targets[0]));
+		targets[ntargets++] = s;
+	}
+	targets = xreallocarray(targets, ntargets + 1, sizeof(targets[0]));
+	targets[ntargets] = NULL;
+
+#ifdef HAVE_INOTIFY
+	readevents();
+#endif
+	if (manifestchanged())
+		load();
+	else if (osmtime(logpath) != logmtime || osmtime(depspath) != depsmtime)
+		loadlogs();
+#ifdef HAVE_INOTIFY
+	while (nunwatched > 0)
+		unwatched[--nunwatched]->mtime = MTIME_UNKNOWN;
+#else
+	/* without change notifications, every file must be checked again */
+	eachnode(invalidate);
+#endif
+	eachnode(refresh);
+
+	if (pipe(pipefd) < 0) {
+		warn("pipe:");
+		goto done;
+	}
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		warn("fork:");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		goto done;
+	}
+	if (pid == 0) {
+		close(listenfd);
+#ifdef HAVE_INOTIFY
+		close(inotifyfd);
+#endif
+		close(fd);
+		close(pipefd[0]);
+		/* the server sees end-of-file once this process exits */
+		fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+		for (i = 0; i < 3; ++i) {
+			if (dup2(fds[i], i) < 0)
+				fatal("dup2:");
+			close(fds[i]);
+		}
+		/* join the client's process group, so that jobs can use its
+		 * terminal and are interrupted along with it. this fails if
+		 * the client is in another session, in which case its terminal
+		 * is not ours, and the build stays in our group */
+		setpgid(0, req.pgid);
+		sa.sa_handler = SIG_DFL;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGPIPE, &sa, NULL);
+		buildopts = req.opts;
+		buildopts.statusfmt = statusfmt;
+		buildopts.cgroup = *cgroup ? cgroup : NULL;
+		logreopen(builddir);
+		depsreopen(builddir);
+		return targets;
+	}
+	close(pipefd[1]);
+
+	/* wait for the build, interrupting it if the client goes away */
+	pfd[0].fd = pipefd[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLIN;
+	killed = false;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll:");
+		}
+		if (pfd[0].revents)
+			break;
+		if (pfd[1].revents && !killed) {
+			/* the build passes the signal on to its jobs */
+			kill(pid, SIGINT);
+			killed = true;
+			pfd[1].fd = -1;
+		}
+	}
+	close(pipefd[0]);
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			fatal("waitpid %d:", (int)pid);
+	}
+	ret = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	writeall(fd, &ret, 1);
+
+done:
+	for (i = 0; i < 3; ++i) {
+		if (fds[i] != -1)
+			close(fds[i]);
+	}
+	close(fd);
+	free(targets);
+	free(buf);
+
+	return NULL;
+}
+
+char **
+serve(const char *name, int *argc)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	char **targets;
+	int fd;
+
+	manifest = name;
+	sockaddr(&addr);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		fatal("socket:");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		fatal("a server is already running in this directory");
+	close(fd);
+	/* remove a socket left behind by a server that is gone */
+	if (unlink(sockname) < 0 && errno != ENOENT)
+		fatal("unlink %s:", sockname);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd < 0)
+		fatal("socket:");
+	fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fatal("bind %s:", sockname);
+	if (listen(listenfd, 16) < 0)
+		fatal("listen:");
+
+	/* a client going away must not take the server with it */
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, NULL);
+
+#ifdef HAVE_INOTIFY
+	inotifyfd = inotify_init();
+	if (inotifyfd < 0)
+		fatal("inotify_init:");
+	fcntl(inotifyfd, F_SETFD, FD_CLOEXEC);
+	fcntl(inotifyfd, F_SETFL, O_NONBLOCK);
+	dirs = mkhtab(256);
+#endif
+	load();
+
+	pfd[0].fd = listenfd;
+	pfd[0].events = POLLIN;
+#ifdef HAVE_INOTIFY
+	pfd[1].fd = inotifyfd;
+#else
+	pfd[1].fd = -1;
+#endif
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll:");
+		}
+#ifdef HAVE_INOTIFY
+		if (pfd[1].revents)
+			readevents();
+#endif
+		if (!pfd[0].revents)
+			continue;
+		fd = accept(listenfd, NULL, NULL);
+		if (fd < 0) {
+			warn("accept:");
+			continue;
+		}
+		targets = request(fd);
+		if (targets) {
+			for (*argc = 0; targets[*argc]; ++*argc)
+				;
+			return targets;
+		}
+	}
+}
@@ -0,0 +1,7 @@
+/* forward a build to a server running in the current directory, returning
+ * its exit status, or -1 if there is no server to build it */
+int serverbuild(const char *, char *[]);
+
+/* load the manifest and serve builds until killed, returning the targets
+ * of a request in a new process for each build */
+char **serve(const char *, int *);
@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "env.h"
+#include "graph.h"
+#include "htab.h"
+#include "os.h"
+#include "statcache.h"
+#include "util.h"
+
+/*
+.samu_stat file format
+
+The header identifying the format is the string "# samustat\n", followed by a
+4-byte integer specifying the format version. After this is a series of
+directory records. All integers are written in system byte-order.
+
+A directory record starts with the path of the directory, its mtime, and a
+4-byte integer counting the file records that follow. A file record is the
+path of a node in that directory and its mtime.
+
+A path is written as a 4-byte length followed by that many bytes. An mtime is
+an 8-byte integer in nanoseconds, or MTIME_MISSING for a file that did not
+exist.
+
+A directory's mtime is queried before the mtimes of any files in it, so the
+recorded file mtimes are valid for as long as the directory mtime stays the
+same. This does not hold for files modified in place, which leave the mtime of
+their directory alone; to catch those, a random sample of the cached mtimes
+is checked against the file system every time the cache is loaded.
+*/
+
+static const char statname[] = ".samu_stat";
+static const char stattmpname[] = ".samu_stat.tmp";
+static const char statheader[] = "# samustat\n";
+static const uint32_t statver = 1;
+
+enum {
+	/* check one in this many cached mtimes */
+	SAMPLERATE = 32,
+	/* a directory changed this recently may change again without
+	 * getting a new mtime, so is not trusted */
+	RACYTIME = 2000000000,
+	MAXPATH = 1 << 20,
+};
+
+struct dir {
+	/* mtime before any of its files were checked, or MTIME_UNKNOWN */
+	int64_t mtime;
+	struct node **node;
+	size_t nnode, nodecap;
+	size_t len;
+	char path[];
+};
+
+static char *statpath, *stattmppath;
+static struct hashtable *dirtab;
+static struct dir **dirs;
+static size_t ndirs, dirscap;
+
+static int64_t
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
+		fatal("clock_gettime:");
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+deldir(void *p)
+{
+	struct dir *d = p;
+
+	free(d->node);
+	free(d);
+}
+
+static struct dir *
+dirget(const char *path, size_t len)
+{
+	struct hashtablekey k;
+	struct dir *d;
+	void **v;
+
+	htabkey(&k, path, len);
+	v = htabput(dirtab, &k);
+	if (*v)
+		return *v;
+	d = xmalloc(sizeof(*d) + len + 1);
+	d->mtime = MTIME_UNKNOWN;
+	d->node = NULL;
+	d->nnode = 0;
+	d->nodecap = 0;
+	d->len = len;
+	memcpy(d->path, path, len);
+	d->path[len] = '\0';
+	/* the key must stay valid after the function returns */
+	htabkey(&k, d->path, len);
+	*v = d;
+	if (ndirs == dirscap) {
+		dirscap = dirscap ? dirscap * 2 : 64;
+		dirs = xreallocarray(dirs, dirscap, sizeof(dirs[0]));
+	}
+	dirs[ndirs++] = d;
+
+	return d;
+}
+
+/* look up the directory containing a node */
+static struct dir *
+nodedir(struct node *n)
+{
+	const char *path, *slash;
+	size_t len;
+
+	path = n->path->s;
+	slash = strrchr(path, '/');
+	if (!slash)
+		return dirget(".", 1);
+	len = slash == path ? 1 : (size_t)(slash - path);
+	return dirget(path, len);
+}
+
+static void
+statclear(void)
+{
+	if (dirtab)
+		delhtab(dirtab, deldir);
+	dirtab = mkhtab(256);
+	ndirs = 0;
+}
+
+static bool
+readpath(FILE *f, struct buffer *buf)
+{
+	uint32_t len;
+
+	if (fread(&len, sizeof(len), 1, f) != 1)
+		return false;
+	if (len > MAXPATH)
+		return false;
+	if (len + 1 > buf->cap) {
+		buf->cap = len + 1;
+		buf->data = xreallocarray(buf->data, buf->cap, 1);
+	}
+	if (len > 0 && fread(buf->data, len, 1, f) != 1)
+		return false;
+	buf->data[len] = '\0';
+	buf->len = len;
+
+	return true;
+}
+
+static void
+writepath(FILE *f, const char *s, size_t n)
+{
+	uint32_t len = n;
+
+	fwrite(&len, sizeof(len), 1, f);
+	fwrite(s, 1, n, f);
+}
+
+static void
+invalidate(struct node *n)
+{
+	n->mtime = MTIME_UNKNOWN;
+}
+
+void
+statinit(const char *builddir)
+{
+	static struct buffer path;
+	char hdr[sizeof(statheader)];
+	struct node *n;
+	struct dir *d;
+	FILE *f;
+	uint32_t ver, count;
+	int64_t t, dirmtime, cur, mtime;
+	uint64_t rng;
+	bool trusted, stale;
+
+	statclear();
+	if (!statpath) {
+		if (builddir) {
+			xasprintf(&statpath, "%s/%s", builddir, statname);
+			xasprintf(&stattmppath, "%s/%s", builddir, stattmpname);
+		} else {
+			statpath = (char *)statname;
+			stattmppath = (char *)stattmpname;
+		}
+	}
+
+	t = now();
+	rng = t | 1;
+	stale = false;
+	f = fopen(statpath, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			warn("open %s:", statpath);
+		return;
+	}
+	if (!fgets(hdr, sizeof(hdr), f) || strcmp(hdr, statheader) != 0)
+		goto invalid;
+	if (fread(&ver, sizeof(ver), 1, f) != 1 || ver != statver)
+		goto invalid;
+	while (readpath(f, &path)) {
+		if (fread(&dirmtime, sizeof(dirmtime), 1, f) != 1 || fread(&count, sizeof(count), 1, f) != 1)
+			goto invalid;
+		cur = osmtime(path.data);
+		trusted = cur == dirmtime && cur != MTIME_MISSING;
+		/* remember the mtime for the next cache, since no file in
+		 * this directory has been checked yet */
+		if (cur != MTIME_MISSING && cur < t - RACYTIME) {
+			d = dirget(path.data, path.len);
+			d->mtime = cur;
+		}
+		for (; count > 0; --count) {
+			if (!readpath(f, &path) || fread(&mtime, sizeof(mtime), 1, f) != 1)
+				goto invalid;
+			if (!trusted)
+				continue;
+			n = nodeget(path.data, path.len);
+			if (!n || n->mtime != MTIME_UNKNOWN)
+				continue;
+			n->mtime = mtime;
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			if (rng % SAMPLERATE == 0 && osmtime(n->path->s) != mtime)
+				stale = true;
+		}
+	}
+	if (!feof(f))
+		goto invalid;
+	fclose(f);
+	if (stale) {
+		warn("stat cache is out of date, checking all files");
+		eachnode(invalidate);
+	}
+	return;
+
+invalid:
+	warn("invalid stat cache, checking all files");
+	fclose(f);
+	eachnode(invalidate);
+}
+
+static void
+adddirnode(struct node *n)
+{
+	struct dir *d;
+
+	if (n->mtime == MTIME_UNKNOWN)
+		return;
+	d = nodedir(n);
+	if (d->nnode == d->nodecap) {
+		d->nodecap = d->nodecap ? d->nodecap * 2 : 8;
+		d->node = xreallocarray(d->node, d->nodecap, sizeof(d->node[0]));
+	}
+	d->node[d->nnode++] = n;
+}
+
+void
+statclose(void)
+{
+	struct dir *d;
+	struct node *n;
+	FILE *f;
+	size_t i, j;
+	uint32_t count;
+	int64_t t;
+
+	if (!statpath)
+		return;
+	eachnode(adddirnode);
+	f = fopen(stattmppath, "w");
+	if (!f) {
+		warn("open %s:", stattmppath);
+		return;
+	}
+	fputs(statheader, f);
+	fwrite(&statver, sizeof(statver), 1, f);
+	t = now();
+	for (i = 0; i < ndirs; ++i) {
+		d = dirs[i];
+		if (d->nnode == 0)
+			continue;
+		if (d->mtime == MTIME_UNKNOWN) {
+			/* the directory was not checked before its files, so
+			 * check them again after it */
+			d->mtime = osmtime(d->path);
+			if (d->mtime == MTIME_MISSING || d->mtime >= t - RACYTIME)
+				continue;
+			for (j = 0; j < d->nnode; ++j)
+				nodestat(d->node[j]);
+		}
+		writepath(f, d->path, d->len);
+		fwrite(&d->mtime, sizeof(d->mtime), 1, f);
+		count = d->nnode;
+		fwrite(&count, sizeof(count), 1, f);
+		for (j = 0; j < d->nnode; ++j) {
+			n = d->node[j];
+			writepath(f, n->path->s, n->path->n);
+			fwrite(&n->mtime, sizeof(n->mtime), 1, f);
+		}
+	}
+	if (ferror(f)) {
+		fclose(f);
+		warn("write %s:", stattmppath);
+		remove(stattmppath);
+	} else if (fclose(f) != 0) {
+		warn("write %s:", stattmppath);
+		remove(stattmppath);
+	} else if (rename(stattmppath, statpath) < 0) {
+		warn("rename %s:", stattmppath);
+	}
+	statclear();
+}
@@ -0,0 +1,4 @@
+/* load the cached mtimes of nodes in directories that have not changed */
+void statinit(const char *);
+/* write the mtimes of all checked nodes to the cache */
+void statclose(void);
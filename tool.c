@@ -11,6 +11,28 @@
 #include "tool.h"
 #include "util.h"
 
+/* a step of a depth-first traversal, with an explicit stack so that deep
+ * graphs can't overflow the call stack */
+struct frame {
+	struct edge *edge;
+	/* the next input to visit */
+	size_t next;
+	size_t depth;
+};
+
+static struct frame *stack;
+static size_t stacklen, stackcap;
+
+static void
+push(struct edge *e, size_t depth)
+{
+	if (stacklen == stackcap) {
+		stackcap = stackcap ? stackcap * 2 : 64;
+		stack = xreallocarray(stack, stackcap, sizeof(stack[0]));
+	}
+	stack[stacklen++] = (struct frame){e, 0, depth};
+}
+
 static int
 cleanpath(struct string *path)
 {
@@ -36,27 +58,42 @@ cleanedge(struct edge *e)
 		if (cleanpath(e->out[i]->path) < 0)
 			ret = -1;
 	}
-	if (cleanpath(edgevar(e, "rspfile", false)) < 0)
+	if (cleanpath(edgevar(e, SYM_RSPFILE, false)) < 0)
 		ret = -1;
-	if (cleanpath(edgevar(e, "depfile", false)) < 0)
+	if (cleanpath(edgevar(e, SYM_DEPFILE, false)) < 0)
 		ret = -1;
 
 	return ret;
 }
 
+/* remove a target, returning whether its inputs should be removed as well */
+static bool
+cleanvisit(struct node *n, int *ret)
+{
+	if (!n->gen || n->gen->rule == &phonyrule)
+		return false;
+	if (cleanpath(n->path) < 0)
+		*ret = -1;
+	return true;
+}
+
 static int
 cleantarget(struct node *n)
 {
 	int ret = 0;
-	size_t i;
-
-	if (!n->gen || n->gen->rule == &phonyrule)
-		return 0;
-	if (cleanpath(n->path) < 0)
-		ret = -1;
-	for (i = 0; i < n->gen->nin; ++i) {
-		if (cleantarget(n->gen->in[i]) < 0)
-			ret = -1;
+	struct frame *f;
+
+	if (cleanvisit(n, &ret))
+		push(n->gen, 0);
+	while (stacklen > 0) {
+		f = &stack[stacklen - 1];
+		if (f->next == f->edge->nin) {
+			--stacklen;
+			continue;
+		}
+		n = f->edge->in[f->next++];
+		if (cleanvisit(n, &ret))
+			push(n->gen, 0);
 	}
 
 	return ret;
@@ -87,7 +124,7 @@ clean(int argc, char *argv[])
 		if (!argc)
 			fatal("expected a rule to clean");
 		for (; *argv; ++argv) {
-			r = envrule(rootenv, *argv);
+			r = envrule(rootenv, symget(*argv));
 			if (!r) {
 				warn("unknown rule '%s'", *argv);
 				ret = 1;
@@ -115,7 +152,7 @@ clean(int argc, char *argv[])
 		for (e = alledges; e; e = e->allnext) {
 			if (e->rule == &phonyrule)
 				continue;
-			if (!cleangen && edgevar(e, "generator", true))
+			if (!cleangen && edgevar(e, SYM_GENERATOR, true))
 				continue;
 			if (cleanedge(e) < 0)
 				ret = 1;
@@ -125,22 +162,39 @@ clean(int argc, char *argv[])
 	return ret;
 }
 
+static bool
+commandsvisit(struct node *n)
+{
+	struct edge *e = n->gen;
+
+	if (!e || (e->flags & FLAG_WORK))
+		return false;
+	e->flags |= FLAG_WORK;
+	return true;
+}
+
 /* depth-first traversal */
 static void
 targetcommands(struct node *n)
 {
-	struct edge *e = n->gen;
+	struct frame *f;
 	struct string *command;
-	size_t i;
 
-	if (!e || (e->flags & FLAG_WORK))
-		return;
-	e->flags |= FLAG_WORK;
-	for (i = 0; i < e->nin; ++i)
-		targetcommands(e->in[i]);
-	command = edgevar(e, "command", true);
-	if (command && command->n)
-		puts(command->s);
+	if (commandsvisit(n))
+		push(n->gen, 0);
+	while (stacklen > 0) {
+		f = &stack[stacklen - 1];
+		if (f->next == f->edge->nin) {
+			command = edgevar(f->edge, SYM_COMMAND, true);
+			if (command && command->n)
+				puts(command->s);
+			--stacklen;
+			continue;
+		}
+		n = f->edge->in[f->next++];
+		if (commandsvisit(n))
+			push(n->gen, 0);
+	}
 }
 
 static int
@@ -215,7 +269,7 @@ compdb(int argc, char *argv[])
 		if (e->nin == 0)
 			continue;
 		for (i = 0; i < argc; ++i) {
-			if (strcmp(e->rule->name, argv[i]) == 0) {
+			if (strcmp(symname(e->rule->name), argv[i]) == 0) {
 				if (first)
 					first = false;
 				else
@@ -225,15 +279,15 @@ compdb(int argc, char *argv[])
 				printquoted(dir, -1, false);
 
 				printf("\",\n    \"command\": \"");
-				cmd = edgevar(e, "command", true);
-				rspfile = expandrsp ? edgevar(e, "rspfile", true) : NULL;
+				cmd = edgevar(e, SYM_COMMAND, true);
+				rspfile = expandrsp ? edgevar(e, SYM_RSPFILE, true) : NULL;
 				p = rspfile ? strstr(cmd->s, rspfile->s) : NULL;
 				if (!p || p == cmd->s || p[-1] != '@') {
 					printquoted(cmd->s, cmd->n, false);
 				} else {
 					off = p - cmd->s;
 					printquoted(cmd->s, off - 1, false);
-					content = edgevar(e, "rspfile_content", true);
+					content = edgevar(e, SYM_RSPFILE_CONTENT, true);
 					printquoted(content->s, content->n, true);
 					off += rspfile->n;
 					printquoted(cmd->s + off, cmd->n - off, false);
@@ -258,28 +312,32 @@ compdb(int argc, char *argv[])
 	return 0;
 }
 
-static void
-graphnode(struct node *n)
+/* print a node, returning whether its generating edge should be visited */
+static bool
+graphvisit(struct node *n)
 {
 	struct edge *e = n->gen;
-	size_t i;
-	const char *style;
 
 	printf("\"%p\" [label=\"", (void *)n);
 	printquoted(n->path->s, n->path->n, false);
 	printf("\"]\n");
 
 	if (!e || (e->flags & FLAG_WORK))
-		return;
+		return false;
 	e->flags |= FLAG_WORK;
+	return true;
+}
 
-	for (i = 0; i < e->nin; ++i)
-		graphnode(e->in[i]);
+static void
+graphedge(struct edge *e)
+{
+	size_t i;
+	const char *style;
 
 	if (e->nin == 1 && e->nout == 1) {
-		printf("\"%p\" -> \"%p\" [label=\"%s\"]\n", (void *)e->in[0], (void *)e->out[0], e->rule->name);
+		printf("\"%p\" -> \"%p\" [label=\"%s\"]\n", (void *)e->in[0], (void *)e->out[0], symname(e->rule->name));
 	} else {
-		printf("\"%p\" [label=\"%s\", shape=ellipse]\n", (void *)e, e->rule->name);
+		printf("\"%p\" [label=\"%s\", shape=ellipse]\n", (void *)e, symname(e->rule->name));
 		for (i = 0; i < e->nout; ++i)
 			printf("\"%p\" -> \"%p\"\n", (void *)e, (void *)e->out[i]);
 		for (i = 0; i < e->nin; ++i) {
@@ -289,6 +347,26 @@ graphnode(struct node *n)
 	}
 }
 
+static void
+graphnode(struct node *n)
+{
+	struct frame *f;
+
+	if (graphvisit(n))
+		push(n->gen, 0);
+	while (stacklen > 0) {
+		f = &stack[stacklen - 1];
+		if (f->next == f->edge->nin) {
+			graphedge(f->edge);
+			--stacklen;
+			continue;
+		}
+		n = f->edge->in[f->next++];
+		if (graphvisit(n))
+			push(n->gen, 0);
+	}
+}
+
 static int
 graph(int argc, char *argv[])
 {
@@ -339,7 +417,7 @@ query(int argc, char *argv[])
 		printf("%s:\n", argv[i]);
 		e = n->gen;
 		if (e) {
-			printf("  input: %s\n", e->rule->name);
+			printf("  input: %s\n", symname(e->rule->name));
 			for (j = 0; j < e->nin; ++j)
 				printf("    %s\n", e->in[j]->path->s);
 		}
@@ -354,8 +432,10 @@ query(int argc, char *argv[])
 	return 0;
 }
 
-static void
-targetsdepth(struct node *n, size_t depth, size_t indent)
+/* print a target indented by its depth, returning whether its inputs should
+ * be printed as well */
+static bool
+targetsvisit(struct node *n, size_t depth, size_t indent)
 {
 	struct edge *e = n->gen;
 	size_t i;
@@ -363,13 +443,30 @@ targetsdepth(struct node *n, size_t depth, size_t indent)
 	for (i = 0; i < indent; ++i)
 		printf("  ");
 	if (e) {
-		printf("%s: %s\n", n->path->s, e->rule->name);
-		if (depth != 1) {
-			for (i = 0; i < e->nin; ++i)
-				targetsdepth(e->in[i], depth - 1, indent + 1);
+		printf("%s: %s\n", n->path->s, symname(e->rule->name));
+		return depth != 1;
+	}
+	puts(n->path->s);
+	return false;
+}
+
+static void
+targetsdepth(struct node *n, size_t depth)
+{
+	struct frame *f;
+
+	if (targetsvisit(n, depth, 0))
+		push(n->gen, depth);
+	while (stacklen > 0) {
+		f = &stack[stacklen - 1];
+		if (f->next == f->edge->nin) {
+			--stacklen;
+			continue;
 		}
-	} else {
-		puts(n->path->s);
+		n = f->edge->in[f->next++];
+		depth = f->depth - 1;
+		if (targetsvisit(n, depth, stacklen))
+			push(n->gen, depth);
 	}
 }
 
@@ -403,7 +500,7 @@ targets(int argc, char *argv[])
 		for (e = alledges; e; e = e->allnext) {
 			for (i = 0; i < e->nout; ++i) {
 				if (e->out[i]->nuse == 0)
-					targetsdepth(e->out[i], depth, 0);
+					targetsdepth(e->out[i], depth);
 			}
 		}
 	} else if (strcmp(mode, "rule") == 0) {
@@ -414,7 +511,7 @@ targets(int argc, char *argv[])
 					if (!e->in[i]->gen)
 						puts(e->in[i]->path->s);
 				}
-			} else if (strcmp(e->rule->name, name) == 0) {
+			} else if (strcmp(symname(e->rule->name), name) == 0) {
 				for (i = 0; i < e->nout; ++i)
 					puts(e->out[i]->path->s);
 			}
@@ -422,7 +519,7 @@ targets(int argc, char *argv[])
 	} else if (strcmp(mode, "all") == 0 && argc == 2) {
 		for (e = alledges; e; e = e->allnext) {
 			for (i = 0; i < e->nout; ++i)
-				printf("%s: %s\n", e->out[i]->path->s, e->rule->name);
+				printf("%s: %s\n", e->out[i]->path->s, symname(e->rule->name));
 		}
 	} else {
 		targetsusage();
@@ -1,9 +1,13 @@
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "util.h"
 
 extern const char *argv0;
@@ -120,6 +124,22 @@ bufadd(struct buffer *buf, char c)
 	buf->data[buf->len++] = c;
 }
 
+void
+bufaddn(struct buffer *buf, const char *s, size_t n)
+{
+	if (n > buf->cap - buf->len) {
+		if (!buf->cap)
+			buf->cap = 1 << 8;
+		while (n > buf->cap - buf->len)
+			buf->cap *= 2;
+		buf->data = realloc(buf->data, buf->cap);
+		if (!buf->data)
+			fatal("realloc:");
+	}
+	memcpy(buf->data + buf->len, s, n);
+	buf->len += n;
+}
+
 struct string *
 mkstr(size_t n)
 {
@@ -139,30 +159,68 @@ delevalstr(void *ptr)
 	while (str) {
 		p = str;
 		str = str->next;
-		if (p->var)
-			free(p->var);
-		else
+		if (p->var == -1)
 			free(p->str);
 		free(p);
 	}
 }
 
+/* check whether canonpath would leave a path unchanged, conservatively */
+static bool
+iscanon(const char *s, const char *end)
+{
+#ifdef __SSE2__
+	__m128i slash, dot, c0, c1;
+	unsigned m;
+#endif
+
+	if (*s == '/')
+		++s;
+	while (end - s >= 3 && memcmp(s, "../", 3) == 0)
+		s += 3;
+	if (s == end || *s == '/' || *s == '.' || end[-1] == '/')
+		return false;
+	/* look for a '/' followed by '/' or '.' */
+#ifdef __SSE2__
+	slash = _mm_set1_epi8('/');
+	dot = _mm_set1_epi8('.');
+	/* the second load may read the terminating null byte */
+	for (; end - s >= 16; s += 16) {
+		c0 = _mm_loadu_si128((const __m128i *)s);
+		c1 = _mm_loadu_si128((const __m128i *)(s + 1));
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(c0, slash));
+		m &= _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c1, slash), _mm_cmpeq_epi8(c1, dot)));
+		if (m)
+			return false;
+	}
+#endif
+	while ((s = memchr(s, '/', end - s))) {
+		++s;
+		if (*s == '/' || *s == '.')
+			return false;
+	}
+	return true;
+}
+
 void
 canonpath(struct string *path)
 {
-	char *component[60];
 	int n;
-	char *s, *d, *end;
+	char *s, *d, *end, *base;
 
 	if (path->n == 0)
 		fatal("empty path");
 	s = d = path->s;
 	end = path->s + path->n;
+	if (iscanon(s, end))
+		return;
 	n = 0;
 	if (*s == '/') {
 		++s;
 		++d;
 	}
+	/* components before base are not removed by '..' */
+	base = d;
 	while (s < end) {
 		switch (s[0]) {
 		case '/':
@@ -177,19 +235,21 @@ canonpath(struct string *path)
 				if (s[2] != '/' && s[2] != '\0')
 					break;
 				if (n > 0) {
-					d = component[--n];
+					/* back up to the start of the last component */
+					for (--d; d > base && d[-1] != '/'; --d)
+						;
+					--n;
 				} else {
 					*d++ = s[0];
 					*d++ = s[1];
 					*d++ = s[2];
+					base = d;
 				}
 				s += 3;
 				continue;
 			}
 		}
-		if (n == countof(component))
-			fatal("path has too many components: %s", path->s);
-		component[n++] = d;
+		++n;
 		while (*s != '/' && *s != '\0')
 			*d++ = *s++;
 		*d++ = *s++;
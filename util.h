@@ -10,7 +10,7 @@ struct string {
 
 /* an unevaluated string */
 struct evalstring {
-	char *var;
+	int var;  /* symbol of the variable, or -1 for literal text */
 	struct string *str;
 	struct evalstring *next;
 };
@@ -29,6 +29,8 @@ int xasprintf(char **, const char *, ...);
 
 /* append a byte to a buffer */
 void bufadd(struct buffer *buf, char c);
+/* append an array of bytes to a buffer */
+void bufaddn(struct buffer *buf, const char *s, size_t n);
 
 /* allocates a new string with length n. n + 1 bytes are allocated for
  * s, but not initialized. */
@@ -0,0 +1,236 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "util.h"
+#include "worker.h"
+
+/*
+Worker protocol
+
+A worker is started by running its command with /bin/sh, with standard input
+and output connected to a socket. For each job, it reads a request made of
+the length of the job's command in decimal followed by a newline, and then
+the command itself. When the job is done, it writes a response made of the
+exit status and the length of the job's output, both in decimal, separated by
+a space and followed by a newline, and then the output itself. The output
+may be at most 64 MiB. A worker runs one job at a time, and should exit when
+its input is closed. Its standard error is discarded.
+*/
+
+enum {
+	/* longest header of a response */
+	MAXHEADER = 64,
+	/* longest output of a response */
+	MAXOUTPUT = 1 << 26,
+};
+
+struct worker {
+	struct string *cmd;
+	pid_t pid;
+	int fd;
+	bool busy;
+	struct worker *next;
+};
+
+static struct worker *workers;
+
+static struct worker *
+workerstart(struct string *cmd)
+{
+	struct worker *w;
+	int fd[2], null;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+		warn("socketpair:");
+		return NULL;
+	}
+	if (fcntl(fd[0], F_SETFD, FD_CLOEXEC) != 0) {
+		warn("fcntl CLOEXEC:");
+		goto err;
+	}
+	pid = fork();
+	switch (pid) {
+	case 0:
+		/* anything written to standard error would end up in the
+		 * middle of the build's status */
+		null = open("/dev/null", O_WRONLY);
+		if (null < 0 || dup2(null, 2) < 0)
+			_exit(1);
+		if (null > 2)
+			close(null);
+		if (dup2(fd[1], 0) < 0 || dup2(fd[1], 1) < 0)
+			_exit(1);
+		if (fd[1] > 1)
+			close(fd[1]);
+		execl("/bin/sh", "/bin/sh", "-c", cmd->s, (char *)NULL);
+		_exit(127);
+	case -1:
+		warn("fork:");
+		goto err;
+	}
+	close(fd[1]);
+	w = xmalloc(sizeof(*w));
+	w->cmd = mkstr(cmd->n);
+	memcpy(w->cmd->s, cmd->s, cmd->n + 1);
+	w->pid = pid;
+	w->fd = fd[0];
+	w->busy = false;
+	w->next = workers;
+	workers = w;
+
+	return w;
+
+err:
+	close(fd[0]);
+	close(fd[1]);
+	return NULL;
+}
+
+struct worker *
+workerget(struct string *cmd)
+{
+	struct worker *w;
+
+	for (w = workers; w; w = w->next) {
+		if (!w->busy && w->cmd->n == cmd->n && memcmp(w->cmd->s, cmd->s, cmd->n) == 0)
+			break;
+	}
+	if (!w) {
+		w = workerstart(cmd);
+		if (!w)
+			return NULL;
+	}
+	w->busy = true;
+
+	return w;
+}
+
+static int
+sendall(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		/* a worker that exited must not kill us with SIGPIPE */
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+workersend(struct worker *w, struct string *cmd)
+{
+	char hdr[32];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr), "%zu\n", cmd->n);
+	if (sendall(w->fd, hdr, n) < 0 || sendall(w->fd, cmd->s, cmd->n) < 0) {
+		warn("send to worker:");
+		return -1;
+	}
+	return w->fd;
+}
+
+pid_t
+workerpid(struct worker *w)
+{
+	return w->pid;
+}
+
+/* parse a decimal number with no sign or leading space, no larger than max */
+static bool
+parsenum(const char *s, char **end, unsigned long max, unsigned long *val)
+{
+	if (!isdigit((unsigned char)*s))
+		return false;
+	errno = 0;
+	*val = strtoul(s, end, 10);
+	return errno == 0 && *val <= max;
+}
+
+int
+workerresponse(struct buffer *buf, int *status)
+{
+	char hdr[MAXHEADER], *nl, *end;
+	size_t hdrlen;
+	unsigned long val, len;
+
+	nl = memchr(buf->data, '\n', buf->len < MAXHEADER ? buf->len : MAXHEADER);
+	if (!nl)
+		return buf->len < MAXHEADER ? 0 : -1;
+	hdrlen = nl - buf->data + 1;
+	memcpy(hdr, buf->data, hdrlen - 1);
+	hdr[hdrlen - 1] = '\0';
+	if (!parsenum(hdr, &end, 255, &val) || *end != ' ')
+		return -1;
+	*status = val;
+	if (!parsenum(end + 1, &end, MAXOUTPUT, &len) || *end)
+		return -1;
+	if (buf->len - hdrlen < len)
+		return 0;
+	if (buf->len - hdrlen > len)
+		return -1;
+	memmove(buf->data, buf->data + hdrlen, len);
+	buf->len = len;
+
+	return 1;
+}
+
+static void
+workerstop(struct worker *w)
+{
+	close(w->fd);
+	while (waitpid(w->pid, NULL, 0) < 0) {
+		if (errno != EINTR) {
+			warn("waitpid %d:", (int)w->pid);
+			break;
+		}
+	}
+	free(w->cmd);
+	free(w);
+}
+
+void
+workerrelease(struct worker *w, bool ok)
+{
+	struct worker **p;
+
+	if (ok) {
+		w->busy = false;
+		return;
+	}
+	for (p = &workers; *p != w; p = &(*p)->next)
+		;
+	*p = w->next;
+	kill(w->pid, SIGTERM);
+	workerstop(w);
+}
+
+void
+workerclose(void)
+{
+	struct worker *w;
+
+	while (workers) {
+		w = workers;
+		workers = w->next;
+		workerstop(w);
+	}
+}
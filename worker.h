@@ -0,0 +1,21 @@
+#include <sys/types.h>  /* for pid_t */
+
+struct buffer;
+struct string;
+struct worker;
+
+/* find an idle worker started with the given command, or start a new one */
+struct worker *workerget(struct string *);
+/* send a job's command to a worker, returning the descriptor to read the
+ * response from, or -1 */
+int workersend(struct worker *, struct string *);
+/* the process ID of a worker */
+pid_t workerpid(struct worker *);
+/* check whether a buffer holds a complete response. if it does, leave only
+ * the job's output in the buffer, store its exit status, and return 1. return
+ * 0 if more is needed, or -1 if the response is invalid */
+int workerresponse(struct buffer *, int *);
+/* make a worker available to other jobs, or stop it if it is not usable */
+void workerrelease(struct worker *, _Bool);
+/* stop all workers, letting them exit after their input is closed */
+void workerclose(void);